@@ -0,0 +1,385 @@
+#pragma once
+
+#include <memory>
+#include <algorithm>
+#include <vector>
+#include <string>
+
+#include "ud_adapter.hpp"
+#include "rc_adapter.hpp"
+
+/**
+ * The Adapter starts all peers on a shared UD channel (UDAdapter), and promotes the busy ones to
+ * dedicated RC QPs (RCAdapter). Idle RC peers are demoted back to UD, so the number of RC QPs in use
+ * stays within max_rc_peers, e.g., the QP cache of the RNIC, at any cluster size.
+ *
+ * Traffic (messages sent & received) is counted per peer in epochs:
+ * - a UD peer with at least promote_msgs messages in an epoch is promoted. If the RC budget is used up,
+ *   the coldest RC peer is demoted for it, if its traffic is less than half of the new one;
+ * - an RC peer without traffic for idle_epochs epochs is demoted.
+ * A demoted peer keeps its (connected) RC QP, which consumes no RNIC cache while unused,
+ * so a later promotion of the same peer is cheap.
+ *
+ * Promotion is agreed by both sides with control messages:
+ *   A: PROMOTE (UD) -> B: connects its RC QP, ACK (UD) -> A: connects its RC QP, READY (RC) -> B.
+ * Control messages over UD may be lost, so the pending states time out after a few epochs.
+ * Connecting an RC QP is a TCP handshake with the peer's RdmaCtrl, so the connections requested by
+ * PROMOTE & ACK are not made in the message callback, but queued and made at the end of the epoch.
+ * A send too large for UD queues the promotion of its peer to the end of the epoch as well.
+ * They (and promotions) still block the worker for the handshake at the end of the epoch, up to the connect
+ * timeout if the peer is unreachable.
+ *
+ * Each message carries an 8-byte header, which is written to the msg_meta_len() bytes before msg,
+ * so the caller shall reserve them (in the registered memory) to avoid copying the payload.
+ * Messages are not ordered across a promotion or demotion, just as UD does not order messages.
+ * Both sides shall connect to each other (connect), and use the same max_msg_size.
+ */
+namespace rdmaio {
+
+class AdaptiveAdapter : public MsgAdapter {
+ public:
+  static const int DEFAULT_MAX_RC_PEERS = 32;
+  static const int DEFAULT_PROMOTE_MSGS = 1024;
+  static const int DEFAULT_IDLE_EPOCHS  = 8;
+  static const int EPOCH_US             = 1000;
+  // the max epochs a promotion can be pending
+  static const int PENDING_EPOCHS       = 4;
+
+  struct Header {
+    uint32_t type;
+    uint32_t reserved;
+  };
+
+  enum {
+    DATA = 0,
+    PROMOTE,
+    ACK,
+    REJECT,
+    READY,
+    DEMOTE
+  };
+
+  AdaptiveAdapter(std::shared_ptr<RdmaCtrl> cm, RNicHandler *rnic, MemoryAttr local_mr,
+                  int w_id, int max_recv_num,
+                  int max_rc_peers = DEFAULT_MAX_RC_PEERS,
+                  int promote_msgs = DEFAULT_PROMOTE_MSGS,
+                  int idle_epochs  = DEFAULT_IDLE_EPOCHS,
+                  int max_msg_size = RCAdapter::DEFAULT_MAX_MSG_SIZE):
+      ud_(new UDAdapter(cm,rnic,local_mr,w_id,max_recv_num)),
+      rc_(new RCAdapter(cm,rnic,local_mr,w_id,max_recv_num,max_msg_size)),
+      node_id_(cm->current_node_id()),
+      worker_id_(w_id),
+      max_rc_peers_(max_rc_peers),
+      promote_msgs_(promote_msgs),
+      idle_epochs_(idle_epochs),
+      max_msg_size_(max_msg_size)
+  {
+    auto handler = [this](const char *msg,int node_id,int tid) {
+      this->handle_msg(msg,node_id,tid);
+    };
+    ud_->set_callback(handler);
+    rc_->set_callback(handler);
+    gettimeofday(&epoch_start_,nullptr);
+  }
+
+  /**
+   * Connect the UD channel to the remote, and remember its address for later promotion
+   */
+  ConnStatus connect(std::string ip,int port) {
+    int node_id = -1;
+    auto ret = ud_->connect(ip,port,&node_id);
+    if(ret == SUCC) {
+      Peer &p = peer(node_id);
+      p.ip   = ip;
+      p.port = port;
+    }
+    return ret;
+  }
+
+  /**
+   * return NOT_READY if the message is too large for UD, and the peer is being promoted to RC
+   * (at the end of the epoch); the caller shall poll and retry.
+   * return WRONG_ARG if the message is too large for UD, and the peer cannot be promoted.
+   */
+  ConnStatus send_to(int node_id,const char *msg,int len) {
+
+    Peer &p = peer(node_id);
+    p.traffic += 1;
+
+    Header *h = (Header *)(msg - sizeof(Header));
+    h->type = DATA;
+
+    if(p.state == RC)
+      return rc_->send_to(node_id,(char *)h,len + sizeof(Header));
+
+    if(len + sizeof(Header) > UDAdapter::MAX_FRAG_MSG_SIZE) {
+      if(len + sizeof(Header) > (size_t)max_msg_size_)
+        return WRONG_ARG;
+      if(p.state == UD) {
+        if(p.port == 0 || p.backoff_epochs > 0)
+          return WRONG_ARG;
+        if(!p.promote_queued) {
+          p.promote_queued = true;
+          promotes_.push_back(node_id);
+        }
+      }
+      return NOT_READY;
+    }
+    return ud_->send_to(node_id,(char *)h,len + sizeof(Header));
+  }
+
+  ConnStatus send_pending(int node_id,const char *msg,int len) {
+    return send_to(node_id,msg,len);
+  }
+
+  void poll_comps() {
+    ud_->poll_comps();
+    rc_->poll_comps();
+
+    if((++polls_ % 64) == 0) {
+      struct timeval now; gettimeofday(&now,nullptr);
+      if(diff_time(now,epoch_start_) >= EPOCH_US) {
+        end_epoch();
+        epoch_start_ = now;
+      }
+    }
+  }
+
+  int msg_meta_len() {
+    return sizeof(Header);
+  }
+
+  // number of peers using (or being promoted to) RC
+  inline int active_rc_peers() const {
+    return active_rc_;
+  }
+
+  inline bool on_rc(int node_id) {
+    return peer(node_id).state == RC;
+  }
+
+ private:
+  enum {
+    UD = 0,
+    PROMOTING,  // PROMOTE sent, waiting for ACK
+    RC_PENDING, // ACK sent, waiting for READY
+    RC
+  };
+
+  struct Peer {
+    int state = UD;
+    std::string ip;
+    int port = 0;
+
+    uint64_t traffic      = 0; // messages in this epoch
+    uint64_t last_traffic = 0; // messages in the last epoch
+    int idle_epochs    = 0;
+    int pending_epochs = 0;
+    int backoff_epochs = 0;    // do not promote the peer until it becomes 0
+    bool promote_queued = false;
+  };
+
+  std::unique_ptr<UDAdapter> ud_;
+  std::unique_ptr<RCAdapter> rc_;
+
+  const int node_id_;   // my node id
+  const int worker_id_; // my thread id
+  const int max_rc_peers_;
+  const uint64_t promote_msgs_;
+  const int idle_epochs_;
+  const int max_msg_size_;
+
+  std::vector<Peer> peers_;
+  int active_rc_ = 0;
+  // the connections requested by PROMOTE & ACK, which are made at the end of the epoch
+  std::vector<std::pair<int,int> > connects_;
+  // the peers to promote for the messages too large for UD, which are promoted at the end of the epoch
+  std::vector<int> promotes_;
+
+  uint64_t polls_ = 0;
+  struct timeval epoch_start_;
+
+  inline Peer &peer(int node_id) {
+    if((size_t)node_id >= peers_.size())
+      peers_.resize(node_id + 1);
+    return peers_[node_id];
+  }
+
+  // control messages are inlined, so they need no registered buffer
+  void send_ctrl(int node_id,uint32_t type,bool via_rc) {
+    Header h = { .type = type,.reserved = 0 };
+    auto ret = via_rc ? rc_->send_to(node_id,(char *)(&h),sizeof(Header))
+               : ud_->send_to(node_id,(char *)(&h),sizeof(Header));
+    RDMA_VERIFY(WARNING,ret == SUCC) << "send control message " << type << " to " << node_id << " error: " << ret;
+  }
+
+  void handle_msg(const char *msg,int node_id,int tid) {
+
+    Header *h = (Header *)msg;
+    Peer &p = peer(node_id);
+
+    switch(h->type) {
+      case DATA:
+        p.traffic += 1;
+        callback_(msg + sizeof(Header),node_id,tid);
+        break;
+      case PROMOTE:
+        if(p.state == RC || p.state == RC_PENDING) {
+          send_ctrl(node_id,ACK,false);
+          break;
+        }
+        if(p.state == UD && (active_rc_ >= max_rc_peers_ || p.port == 0))
+          send_ctrl(node_id,REJECT,false);
+        else
+          connects_.push_back(std::make_pair(node_id,PROMOTE));
+        break;
+      case ACK:
+        if(p.state == PROMOTING)
+          connects_.push_back(std::make_pair(node_id,ACK));
+        break;
+      case REJECT:
+        if(p.state == PROMOTING) {
+          set_state(p,UD);
+          p.backoff_epochs = idle_epochs_;
+        }
+        break;
+      case READY:
+        if(p.state == RC_PENDING)
+          set_state(p,RC);
+        break;
+      case DEMOTE:
+        set_state(p,UD);
+        break;
+      default:
+        RDMA_LOG(WARNING) << "unknown message type " << h->type << " from " << node_id;
+    }
+  }
+
+  void set_state(Peer &p,int state) {
+    bool was_active = (p.state != UD);
+    bool is_active  = (state != UD);
+    active_rc_ += (int)is_active - (int)was_active;
+    p.state = state;
+    p.pending_epochs = 0;
+    p.idle_epochs    = 0;
+  }
+
+  /**
+   * Start to promote the peer, if the RC budget allows
+   * return false if the peer cannot be promoted
+   */
+  bool promote(int node_id) {
+
+    Peer &p = peer(node_id);
+    if(p.port == 0 || p.backoff_epochs > 0)
+      return false;
+
+    if(active_rc_ >= max_rc_peers_) {
+      // find the coldest RC peer
+      int coldest = -1;
+      for(uint i = 0;i < peers_.size();++i) {
+        if(peers_[i].state == RC && (coldest < 0 || peers_[i].last_traffic < peers_[coldest].last_traffic))
+          coldest = i;
+      }
+      if(coldest < 0 || peers_[coldest].last_traffic * 2 >= std::max(p.traffic,p.last_traffic))
+        return false;
+      demote(coldest);
+    }
+
+    // create the local RC QP, so that the remote can connect to it
+    auto ret = rc_->connect(p.ip,p.port);
+    if(ret != SUCC && ret != NOT_READY)
+      return false;
+    set_state(p,PROMOTING);
+    send_ctrl(node_id,PROMOTE,false);
+    return true;
+  }
+
+  void demote(int node_id) {
+    Peer &p = peer(node_id);
+    if(p.state == UD)
+      return;
+    send_ctrl(node_id,DEMOTE,p.state == RC);
+    set_state(p,UD);
+  }
+
+  // make the connections requested by the control messages of this epoch
+  void run_connects() {
+
+    for(auto &c : connects_) {
+      int node_id = c.first;
+      Peer &p = peer(node_id);
+
+      if(c.second == PROMOTE) {
+        if(p.state == RC || p.state == RC_PENDING)
+          continue;  // a duplicated PROMOTE, which has been acked
+        // if both sides are promoting each other, the lower node id drives
+        bool accept = (p.state == UD && active_rc_ < max_rc_peers_) ||
+                      (p.state == PROMOTING && node_id < node_id_);
+        if(accept && p.port != 0 && rc_->connect(p.ip,p.port) == SUCC) {
+          set_state(p,RC_PENDING);
+          send_ctrl(node_id,ACK,false);
+        } else if(p.state == UD) {
+          send_ctrl(node_id,REJECT,false);
+        }
+        continue;
+      }
+
+      // ACK
+      if(p.state != PROMOTING)
+        continue;
+      if(rc_->connect(p.ip,p.port) == SUCC) {
+        set_state(p,RC);
+        send_ctrl(node_id,READY,true);
+      } else {
+        set_state(p,UD);
+        p.backoff_epochs = idle_epochs_;
+        send_ctrl(node_id,DEMOTE,false);
+      }
+    }
+    connects_.clear();
+
+    for(int node_id : promotes_) {
+      Peer &p = peer(node_id);
+      p.promote_queued = false;
+      // a failed one is backed off, so the large messages to it fail (WRONG_ARG) instead of waiting
+      if(p.state == UD && !promote(node_id))
+        p.backoff_epochs = idle_epochs_;
+    }
+    promotes_.clear();
+  }
+
+  void end_epoch() {
+
+    run_connects();
+    for(uint i = 0;i < peers_.size();++i) {
+      Peer &p = peers_[i];
+
+      switch(p.state) {
+        case UD:
+          if(p.backoff_epochs > 0)
+            p.backoff_epochs -= 1;
+          else if(p.traffic >= promote_msgs_)
+            promote(i);
+          break;
+        case PROMOTING:
+        case RC_PENDING:
+          // the control messages may be lost
+          if(++p.pending_epochs >= PENDING_EPOCHS) {
+            demote(i);
+            p.backoff_epochs = idle_epochs_;
+          }
+          break;
+        case RC:
+          p.idle_epochs = (p.traffic == 0) ? p.idle_epochs + 1 : 0;
+          if(p.idle_epochs >= idle_epochs_)
+            demote(i);
+          break;
+      }
+      p.last_traffic = p.traffic;
+      p.traffic = 0;
+    }
+  }
+};
+
+} // namespace rdmaio
@@ -0,0 +1,227 @@
+#pragma once
+
+#include <infiniband/verbs.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "logging.hpp"
+
+namespace rdmaio {
+
+/**
+ * A lock-free cache of address handlers, shared by all UD QPs of a device.
+ * An AH is keyed by the peer's address (GID & LID, port) and its service level & traffic class,
+ * so a process creates one AH per peer, instead of one per peer per UD QP.
+ *
+ * It is an open-addressing hash table of fixed capacity. Entries are never removed, so a lookup
+ * probes from the key's hash until it finds the key, or an empty slot which is claimed (with a CAS)
+ * to create the AH. A slot being filled by another thread is waited for.
+ * It is only used when connecting, so the sends are not affected.
+ */
+class AHCache {
+ public:
+  static const uint32_t DEFAULT_CAPACITY = 1 << 16;
+
+  explicit AHCache(uint32_t capacity = DEFAULT_CAPACITY):
+      capacity_(capacity),
+      slots_(new Slot[capacity])
+  {
+    RDMA_ASSERT((capacity & (capacity - 1)) == 0) << "capacity must be a power of 2";
+  }
+
+  ~AHCache() {
+    clear();
+  }
+
+  /**
+   * Get the AH of the attr, creating it at the pd if it is not cached.
+   * Only the destination (dgid, dlid, port), sl and traffic class are the key;
+   * the AH is created with the attr seen first.
+   * return nullptr if the AH cannot be created, or the cache is full.
+   */
+  ibv_ah *get(ibv_pd *pd,ibv_ah_attr &attr) {
+
+    Key key = {
+      .subnet_prefix = attr.grh.dgid.global.subnet_prefix,
+      .interface_id  = attr.grh.dgid.global.interface_id,
+      .lid           = attr.dlid,
+      .port          = attr.port_num,
+      .sl            = attr.sl,
+      .traffic_class = attr.grh.traffic_class
+    };
+
+    uint32_t mask = capacity_ - 1;
+    for(uint32_t i = 0,pos = hash(key) & mask;i < capacity_;++i,pos = (pos + 1) & mask) {
+      Slot &s = slots_[pos];
+
+      while(true) {
+        int state = s.state.load(std::memory_order_acquire);
+        if(state == READY) {
+          if(s.key == key)
+            return s.ah;
+          break; // probe the next
+        }
+        if(state == BUSY) {
+          asm volatile("pause" ::: "memory");
+          continue;
+        }
+        // empty, try to claim it
+        if(!s.state.compare_exchange_strong(state,BUSY,std::memory_order_acquire))
+          continue;
+        s.key = key;
+        s.ah  = ibv_create_ah(pd,&attr);
+        if(s.ah == nullptr) {
+          s.state.store(EMPTY,std::memory_order_release);
+          return nullptr;
+        }
+        s.state.store(READY,std::memory_order_release);
+        return s.ah;
+      }
+    }
+    RDMA_LOG(WARNING) << "address handler cache is full, capacity " << capacity_;
+    return nullptr;
+  }
+
+  /**
+   * Destroy the cached AHs; shall be called before the pd is deallocated, and no AH is in use.
+   */
+  void clear() {
+    for(uint32_t i = 0;i < capacity_;++i) {
+      if(slots_[i].state.load() == READY)
+        ibv_destroy_ah(slots_[i].ah);
+      slots_[i].state.store(EMPTY);
+    }
+  }
+
+ private:
+  enum {
+    EMPTY = 0,
+    BUSY,
+    READY
+  };
+
+  struct Key {
+    uint64_t subnet_prefix;
+    uint64_t interface_id;
+    uint16_t lid;
+    uint8_t  port;
+    uint8_t  sl;
+    uint8_t  traffic_class;
+
+    bool operator==(const Key &o) const {
+      return subnet_prefix == o.subnet_prefix && interface_id == o.interface_id &&
+          lid == o.lid && port == o.port && sl == o.sl && traffic_class == o.traffic_class;
+    }
+  };
+
+  struct Slot {
+    std::atomic<int> state = { EMPTY };
+    Key     key;
+    ibv_ah *ah = nullptr;
+  };
+
+  const uint32_t capacity_;
+  std::unique_ptr<Slot[]> slots_;
+
+  static inline uint32_t hash(const Key &k) {
+    // murmur3's 64-bit finalizer
+    uint64_t h = k.subnet_prefix ^ (k.interface_id * 0x9e3779b97f4a7c15ULL)
+                 ^ ((uint64_t)k.lid << 24 | (uint64_t)k.port << 16 | k.sl << 8 | k.traffic_class);
+    h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (uint32_t)h;
+  }
+};
+
+/**
+ * The peers of the UD QPs of a device, indexed by the node id: the node's AH (and its attr), and the QPNs
+ * of its UD QPs. A UD QP only points to the table, so its memory does not grow with the cluster size.
+ *
+ * A remote UD QP is identified by its worker id & index; each one used by the device is given a slot,
+ * and an entry keeps the QPN of the node's QP at each slot. The entries are allocated in chunks of
+ * CHUNK_SIZE nodes, which are never moved or freed, so the senders read them without locks;
+ * updates (connecting) take a lock.
+ */
+class UDPeerTable {
+ public:
+  static const int MAX_NODES  = 1 << 16;  // the node id in QPAttr is 16-bit
+  static const int CHUNK_SIZE = 64;
+  static const int MAX_SLOTS  = 64;
+
+  struct Entry {
+    std::atomic<ibv_ah *> ah = { nullptr };
+    ibv_ah_attr ah_attr;
+    uint32_t    qpns[MAX_SLOTS];
+  };
+
+  UDPeerTable():
+      chunks_(new std::atomic<Entry *>[MAX_NODES / CHUNK_SIZE])
+  {
+    for(int i = 0;i < MAX_NODES / CHUNK_SIZE;++i)
+      chunks_[i].store(nullptr);
+  }
+
+  ~UDPeerTable() {
+    for(int i = 0;i < MAX_NODES / CHUNK_SIZE;++i)
+      delete [] chunks_[i].load();
+  }
+
+  /**
+   * The slot of the remote UD QP (worker_id, index).
+   * return -1 if the device has used MAX_SLOTS remote QPs.
+   */
+  int slot(int worker_id,int index) {
+    std::lock_guard<std::mutex> guard(lock_);
+    uint32_t key = ((uint32_t)worker_id << 8) | (uint32_t)index;
+    for(size_t i = 0;i < slot_keys_.size();++i) {
+      if(slot_keys_[i] == key)
+        return i;
+    }
+    if(slot_keys_.size() >= MAX_SLOTS)
+      return -1;
+    slot_keys_.push_back(key);
+    return slot_keys_.size() - 1;
+  }
+
+  /**
+   * Record the QPN of the node's QP at slot, and replace the node's AH, created with ah_attr
+   */
+  void set(int node_id,int slot,uint32_t qpn,ibv_ah *ah,const ibv_ah_attr &ah_attr) {
+    std::lock_guard<std::mutex> guard(lock_);
+    Entry &e = alloc(node_id);
+    e.qpns[slot] = qpn;
+    e.ah_attr    = ah_attr;
+    e.ah.store(ah,std::memory_order_release);
+  }
+
+  /**
+   * The entry of the node, or nullptr if no QP of the device has connected to it
+   */
+  inline Entry *get(int node_id) const {
+    if(node_id < 0 || node_id >= MAX_NODES)
+      return nullptr;
+    Entry *chunk = chunks_[node_id / CHUNK_SIZE].load(std::memory_order_acquire);
+    if(chunk == nullptr)
+      return nullptr;
+    Entry *e = &chunk[node_id % CHUNK_SIZE];
+    return e->ah.load(std::memory_order_acquire) == nullptr ? nullptr : e;
+  }
+
+ private:
+  std::unique_ptr<std::atomic<Entry *>[]> chunks_;
+  std::vector<uint32_t> slot_keys_;
+  std::mutex lock_;
+
+  // with the lock held
+  Entry &alloc(int node_id) {
+    auto &chunk = chunks_[node_id / CHUNK_SIZE];
+    if(chunk.load() == nullptr)
+      chunk.store(new Entry[CHUNK_SIZE],std::memory_order_release);
+    return chunk.load()[node_id % CHUNK_SIZE];
+  }
+};
+
+} // namespace rdmaio
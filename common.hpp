@@ -34,12 +34,18 @@ struct QPAttr {
 
 /**
  * The QP connection requests sent to remote.
- * from_node & from_worker identifies which QP it shall connect to
+ * from_node, from_worker & from_index identifies which QP it shall connect to.
+ * If reset is set, the remote QP is reset and re-connected to the requester's QP (attr),
+ * which is used when the requester recovers its QP from errors; reset is the requester's recovery round
+ * (never 0), so the retries of one reset are told from a later one.
  */
 struct QPConnArg {
   uint16_t from_node;
   uint8_t  from_worker;
-  uint8_t  qp_type; // RC QP or UD QP
+  uint8_t  qp_type; // RC, UC or UD QP
+  uint8_t  from_index;
+  uint8_t  reset;
+  QPAttr   attr;
 };
 
 /**
@@ -49,11 +55,21 @@ struct MRConnArg {
   uint64_t mr_id;
 };
 
+/**
+ * The multicast group membership queries sent to remote.
+ * The remote acks if its worker has joined the group.
+ */
+struct GroupConnArg {
+  uint32_t group_id;
+  uint8_t  worker_id;
+};
+
 struct ConnArg {
-  enum { MR, QP } type;
+  enum { MR, QP, GROUP } type;
   union {
     QPConnArg qp;
     MRConnArg mr;
+    GroupConnArg group;
   } payload;
 };
 
@@ -62,6 +78,7 @@ struct ConnReply {
   union {
     QPAttr qp;
     MemoryAttr mr;
+    uint16_t node_id; // the remote's node id, for GROUP
   } payload;
 };
 
@@ -87,12 +104,22 @@ inline int convert_mtu(ibv_mtu type) {
   return mtu;
 }
 
+/**
+ * The traffic class of RoCE carries the DSCP in its upper 6 bits, and ECN in the lower 2 bits.
+ * The switches map the DSCP (RoCE), or the service level (Infiniband), to their priority queues.
+ */
+inline constexpr int dscp_to_traffic_class(int dscp) {
+  return (dscp & 0x3f) << 2;
+}
+
 // The structure used to configure UDQP
 typedef struct {
   int max_send_size;
   int max_recv_size;
   int qkey;
   int psn;
+  int sl;            // service level of the address handlers
+  int traffic_class; // traffic class of the address handlers
 } UDConfig;
 
 typedef struct {
@@ -102,6 +129,17 @@ typedef struct {
   int rq_psn;
   int sq_psn;
   int timeout;
+  int sl;            // service level
+  int traffic_class; // traffic class, see dscp_to_traffic_class
 } RCConfig;
 
+// The structure used to configure UCQP
+typedef struct {
+  int access_flags;
+  int rq_psn;
+  int sq_psn;
+  int sl;
+  int traffic_class;
+} UCConfig;
+
 } // namespace rdmaio
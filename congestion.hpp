@@ -0,0 +1,75 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+namespace rdmaio {
+
+struct CCConfig {
+  uint64_t line_rate;        // bytes per second, which is also the initial rate
+  uint64_t min_rate;
+  uint64_t burst;            // bytes sent back-to-back at most
+  uint32_t target_delay_us;  // RTTs below it mean an empty queue
+  uint64_t ai;               // additive increase (bytes per second) per RTT
+  double   beta;             // multiplicative decrease factor
+  double   max_mdf;          // max decrease per RTT
+};
+
+inline constexpr CCConfig default_cc_config() {
+  return CCConfig {
+    .line_rate       = 100ULL * 1000 * 1000 * 1000 / 8,  // 100Gbps
+    .min_rate        = 10ULL * 1000 * 1000,              // 10MB/s
+    .burst           = 16 * 1024,
+    .target_delay_us = 25,
+    .ai              = 1000ULL * 1000 * 1000 / 8,        // 1Gbps
+    .beta            = 0.8,
+    .max_mdf         = 0.5
+  };
+}
+
+/**
+ * A delay-based rate controller in the style of Swift.
+ * A sender keeps one per peer, and feeds it with the RTT samples to the peer:
+ * - an RTT below the target increases the rate additively, once per RTT;
+ * - otherwise the rate is decreased in proportion to the excess delay, at most once per RTT.
+ * The rate starts at the line rate, so an idle path is not throttled.
+ */
+class RateController {
+ public:
+  explicit RateController(const CCConfig &config):
+      config_(config),
+      rate_(config.line_rate)
+  {
+  }
+
+  /**
+   * return the new rate
+   */
+  uint64_t on_rtt(uint64_t rtt_ns,uint64_t now_ns) {
+
+    uint64_t target = config_.target_delay_us * 1000ULL;
+    if(rtt_ns < target) {
+      if(now_ns - last_increase_ns_ >= rtt_ns) {
+        rate_ = std::min(config_.line_rate,rate_ + config_.ai);
+        last_increase_ns_ = now_ns;
+      }
+    } else if(now_ns - last_decrease_ns_ >= rtt_ns) {
+      double factor = std::max(1.0 - config_.beta * (rtt_ns - target) / rtt_ns,1.0 - config_.max_mdf);
+      rate_ = std::max(config_.min_rate,(uint64_t)(rate_ * factor));
+      last_decrease_ns_ = now_ns;
+    }
+    return rate_;
+  }
+
+  inline uint64_t rate() const {
+    return rate_;
+  }
+
+ private:
+  const CCConfig config_;
+  uint64_t rate_;
+  uint64_t last_increase_ns_ = 0;
+  uint64_t last_decrease_ns_ = 0;
+};
+
+} // namespace rdmaio
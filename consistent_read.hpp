@@ -0,0 +1,242 @@
+#pragma once
+
+#include <vector>
+
+#include "rdma_ctrl.hpp"
+
+/**
+ * Consistent one-sided reads of remote objects, which may be concurrently updated by local writers.
+ * An object carries version words, so the reader can validate the copy fetched by a single RDMA read,
+ * and re-read it if the copy is torn.
+ *
+ * Two layouts are supported:
+ * - HEADER_TRAILER: | version | payload (8-byte aligned) | version |.
+ *   The writer bumps the trailer to an odd version first, writes the payload, then sets the header and
+ *   the trailer to the next even version. A copy is consistent if both versions are equal.
+ * - PER_CACHE_LINE (FaRM style): each 64-byte line starts with a version word, followed by 56 bytes payload.
+ *   The version of the first line is the object header, which is odd while the object is being written.
+ *   A copy is consistent if all lines carry the same even version.
+ *
+ * Both layouts assume that the RNIC reads an object in increasing address order,
+ * and the per-cache-line one also assumes that a cache line is read atomically.
+ */
+namespace rdmaio {
+
+enum VersionLayout {
+  HEADER_TRAILER = 0,
+  PER_CACHE_LINE = 1
+};
+
+class VersionedObject {
+ public:
+  static const uint32_t LINE_SIZE    = 64;
+  static const uint32_t LINE_PAYLOAD = LINE_SIZE - sizeof(uint64_t);
+
+  /**
+   * The size of the object holding a payload of len (> 0) bytes
+   */
+  static inline uint32_t object_size(uint32_t len,VersionLayout layout) {
+    RDMA_ASSERT(len > 0) << "an object holds at least one byte";
+    if(layout == HEADER_TRAILER)
+      return sizeof(uint64_t) + align(len) + sizeof(uint64_t);
+    return ((len + LINE_PAYLOAD - 1) / LINE_PAYLOAD) * LINE_SIZE;
+  }
+
+  /**
+   * Update the (local) object with the payload; the object shall be zero-initialized before its first write.
+   * Concurrent writers to one object shall be serialized by the caller.
+   */
+  static void write(char *obj,const char *payload,uint32_t len,VersionLayout layout) {
+
+    volatile uint64_t *header = (volatile uint64_t *)obj;
+    uint64_t version = *header;
+
+    if(layout == HEADER_TRAILER) {
+      volatile uint64_t *trailer = (volatile uint64_t *)(obj + sizeof(uint64_t) + align(len));
+      *trailer = version + 1;
+      asm volatile("" ::: "memory");
+      memcpy(obj + sizeof(uint64_t),payload,len);
+      asm volatile("" ::: "memory");
+      *header  = version + 2;
+      asm volatile("" ::: "memory");
+      *trailer = version + 2;
+      return;
+    }
+
+    *header = version + 1; // locked
+    asm volatile("" ::: "memory");
+    uint32_t lines = object_size(len,layout) / LINE_SIZE;
+    for(uint32_t i = 1;i < lines;++i) {
+      char *line = obj + i * LINE_SIZE;
+      // the version goes first, so a partially written line is detected
+      *((volatile uint64_t *)line) = version + 2;
+      asm volatile("" ::: "memory");
+      memcpy(line + sizeof(uint64_t),payload + i * LINE_PAYLOAD,std::min((uint32_t)LINE_PAYLOAD,len - i * LINE_PAYLOAD));
+    }
+    memcpy(obj + sizeof(uint64_t),payload,std::min((uint32_t)LINE_PAYLOAD,len));
+    asm volatile("" ::: "memory");
+    *header = version + 2;
+  }
+
+  /**
+   * Validate a copy of the object.
+   * return true if it is consistent, and its version is stored in version.
+   */
+  static bool validate(const char *obj,uint32_t obj_size,VersionLayout layout,uint64_t &version) {
+
+    version = *((const uint64_t *)obj);
+    if(layout == HEADER_TRAILER)
+      return version == *((const uint64_t *)(obj + obj_size - sizeof(uint64_t)));
+
+    if(version & 1)
+      return false;
+    for(uint32_t off = LINE_SIZE;off < obj_size;off += LINE_SIZE) {
+      if(*((const uint64_t *)(obj + off)) != version)
+        return false;
+    }
+    return true;
+  }
+
+  /**
+   * Copy the payload out of a (validated) copy of the object
+   */
+  static void read_payload(const char *obj,char *payload,uint32_t len,VersionLayout layout) {
+    if(layout == HEADER_TRAILER) {
+      memcpy(payload,obj + sizeof(uint64_t),len);
+      return;
+    }
+    for(uint32_t i = 0;i * LINE_PAYLOAD < len;++i)
+      memcpy(payload + i * LINE_PAYLOAD,obj + i * LINE_SIZE + sizeof(uint64_t),
+             std::min((uint32_t)LINE_PAYLOAD,len - i * LINE_PAYLOAD));
+  }
+
+ private:
+  static inline uint32_t align(uint32_t len) {
+    return (len + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+  }
+};
+
+/**
+ * Read objects through an RC QP, to the remote MR bound to it.
+ * The local buffers must be inside the local MR of the QP. The QP shall not have other signaled
+ * requests outstanding while reading, since the reader waits for its own completions.
+ */
+class ConsistentReader {
+ public:
+  static const int DEFAULT_MAX_RETRIES = 64;
+  static const int MAX_BACKOFF_US      = 128;
+
+  struct ReadReq {
+    uint64_t      off;      // offset of the object in the remote MR
+    char         *buf;      // local buffer for the copy of the object
+    uint32_t      size;     // object size, see VersionedObject::object_size
+    VersionLayout layout;
+
+    // results
+    ConnStatus result;
+    uint64_t   version;
+  };
+
+  explicit ConsistentReader(RCQP *qp,int max_retries = DEFAULT_MAX_RETRIES):
+      qp_(qp),
+      max_retries_(max_retries)
+  {
+  }
+
+  /**
+   * Read one object; a consistent read takes one round trip in the common case.
+   * return NOT_READY if the object is still inconsistent (being written) after max_retries.
+   */
+  ConnStatus read(uint64_t off,char *buf,uint32_t size,VersionLayout layout,uint64_t *version = nullptr) {
+    ReadReq req = { .off = off,.buf = buf,.size = size,.layout = layout,.result = NOT_READY,.version = 0 };
+    read_batch(&req,1);
+    if(version != nullptr)
+      *version = req.version;
+    return req.result;
+  }
+
+  /**
+   * Read many objects, whose reads are posted with one doorbell and validated together.
+   * Only the inconsistent ones are re-read in the next round.
+   * return SUCC if all objects are read consistently; the result of each one is in its ReadReq.
+   */
+  ConnStatus read_batch(ReadReq *reqs,int num) {
+
+    std::vector<int> pendings(num);
+    for(int i = 0;i < num;++i) {
+      pendings[i] = i;
+      reqs[i].result = NOT_READY;
+    }
+
+    int backoff_us = 1;
+    for(int retry = 0;retry <= max_retries_ && !pendings.empty();++retry) {
+
+      if(retry > 0) {
+        usleep(backoff_us);
+        backoff_us = std::min(backoff_us * 2,(int)MAX_BACKOFF_US);
+      }
+
+      // post in chunks, so the send queue never overflows
+      for(size_t start = 0;start < pendings.size();start += MAX_BATCH) {
+        int n = std::min((int)(pendings.size() - start),(int)MAX_BATCH);
+        auto ret = post_reads(reqs,&pendings[start],n);
+        if(ret != SUCC) {
+          for(int i = 0;i < n;++i)
+            reqs[pendings[start + i]].result = ret;
+          return ret;
+        }
+      }
+
+      std::vector<int> inconsistent;
+      for(int i : pendings) {
+        ReadReq &r = reqs[i];
+        if(VersionedObject::validate(r.buf,r.size,r.layout,r.version))
+          r.result = SUCC;
+        else
+          inconsistent.push_back(i);
+      }
+      pendings.swap(inconsistent);
+    }
+    return pendings.empty() ? SUCC : NOT_READY;
+  }
+
+ private:
+  static const int MAX_BATCH = RCQPImpl::RC_MAX_SEND_SIZE / 2;
+
+  RCQP *qp_;
+  const int max_retries_;
+
+  struct ibv_send_wr srs_[MAX_BATCH];
+  struct ibv_sge     sges_[MAX_BATCH];
+
+  // post the reads, and wait for the last one, which is the only signaled one
+  ConnStatus post_reads(ReadReq *reqs,int *idxs,int num) {
+
+    for(int i = 0;i < num;++i) {
+      ReadReq &r = reqs[idxs[i]];
+
+      sges_[i].addr   = (uint64_t)r.buf;
+      sges_[i].length = r.size;
+      sges_[i].lkey   = qp_->local_mr_.key;
+
+      srs_[i].wr_id      = 0;
+      srs_[i].opcode     = IBV_WR_RDMA_READ;
+      srs_[i].num_sge    = 1;
+      srs_[i].sg_list    = &sges_[i];
+      srs_[i].send_flags = (i == num - 1) ? IBV_SEND_SIGNALED : 0;
+      srs_[i].wr.rdma.remote_addr = qp_->remote_mr_.buf + r.off;
+      srs_[i].wr.rdma.rkey        = qp_->remote_mr_.key;
+      srs_[i].next       = (i == num - 1) ? nullptr : &srs_[i + 1];
+    }
+
+    struct ibv_send_wr *bad_sr;
+    auto ret = qp_->post_batch(&srs_[0],&bad_sr);
+    if(ret != SUCC)
+      return ret;
+
+    ibv_wc wc;
+    return qp_->poll_till_completion(wc,no_timeout);
+  }
+};
+
+} // namespace rdmaio
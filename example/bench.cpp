@@ -0,0 +1,114 @@
+#include "rdma_ctrl.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * A loopback RDMA write throughput benchmark.
+ * The QP connects to itself through the local RdmaCtrl, so a single process (and a single RNIC) is enough.
+ *
+ * Usage: ./bench [rc|uc|rc-wc|rc-tmpl] [payload size] [number of writes]
+ * rc-wc enables write combining on the RC QP; the writes go to contiguous remote offsets, so they are merged.
+ * rc-tmpl posts with the pre-built request (RCQP::post<op,flags>), so compared with rc, it shows the posting cost per op.
+ */
+int node_id  = 0;
+int tcp_port = 8888;
+
+const int buf_size = 4 * 1024 * 1024;
+const int mr_id    = 73;
+
+using namespace rdmaio;
+
+template <class QPType>
+double run(QPType *qp,int payload,uint64_t total) {
+
+    const int signal_interval = 64;
+    ibv_wc wc;
+    char *local_buf = (char *)(qp->local_mr_.buf);
+
+    struct timeval start; gettimeofday(&start,nullptr);
+    for(uint64_t i = 0;i < total;++i) {
+        int flags = ((i % signal_interval) == 0) ? IBV_SEND_SIGNALED : 0;
+        if(payload <= MAX_INLINE_SIZE)
+            flags |= IBV_SEND_INLINE;
+        uint64_t off = (i * payload) % (buf_size / 2);
+        auto rc = qp->post_send(IBV_WR_RDMA_WRITE,local_buf,payload,buf_size / 2 + off,flags);
+        RDMA_ASSERT(rc == SUCC) << "post write error at " << i;
+        if(flags & IBV_SEND_SIGNALED) {
+            rc = qp->poll_till_completion(wc,no_timeout);
+            RDMA_ASSERT(rc == SUCC) << "poll write error at " << i;
+        }
+    }
+    struct timeval end; gettimeofday(&end,nullptr);
+    double usec = (end.tv_sec - start.tv_sec) * 1000000.0 + (end.tv_usec - start.tv_usec);
+    return total / usec; // M ops per second
+}
+
+template <int flags>
+double run_tmpl(RCQP *qp,int payload,uint64_t total) {
+
+    const int signal_interval = 64;
+    ibv_wc wc;
+    char *local_buf = (char *)(qp->local_mr_.buf);
+
+    struct timeval start; gettimeofday(&start,nullptr);
+    for(uint64_t i = 0;i < total;++i) {
+        uint64_t off = (i * payload) % (buf_size / 2);
+        if((i % signal_interval) == 0) {
+            auto rc = qp->post<IBV_WR_RDMA_WRITE,flags | IBV_SEND_SIGNALED>(local_buf,payload,buf_size / 2 + off);
+            RDMA_ASSERT(rc == SUCC) << "post write error at " << i;
+            rc = qp->poll_till_completion(wc,no_timeout);
+            RDMA_ASSERT(rc == SUCC) << "poll write error at " << i;
+        } else {
+            auto rc = qp->post<IBV_WR_RDMA_WRITE,flags>(local_buf,payload,buf_size / 2 + off);
+            RDMA_ASSERT(rc == SUCC) << "post write error at " << i;
+        }
+    }
+    struct timeval end; gettimeofday(&end,nullptr);
+    double usec = (end.tv_sec - start.tv_sec) * 1000000.0 + (end.tv_usec - start.tv_usec);
+    return total / usec; // M ops per second
+}
+
+int main(int argc, char *argv[])
+{
+    std::string type = argc > 1 ? argv[1] : "rc";
+    int payload      = argc > 2 ? atoi(argv[2]) : 64;
+    uint64_t total   = argc > 3 ? atoll(argv[3]) : 1000000;
+
+    RdmaCtrl *c = new RdmaCtrl(node_id,tcp_port);
+    RdmaCtrl::DevIdx idx {.dev_id = 0,.port_id = 1 }; // using the first RNIC's first port
+    c->open_thread_local_device(idx);
+
+    char *buffer = (char *)malloc(buf_size);
+    memset(buffer, 0, buf_size);
+    RDMA_ASSERT(c->register_memory(mr_id,buffer,buf_size,c->get_device()) == true);
+
+    MemoryAttr local_mr = c->get_local_mr(mr_id);
+    double mops = 0;
+
+    if(type == "uc") {
+        UCQP *qp = c->create_uc_qp(create_rc_idx(node_id,0),c->get_device(),&local_mr);
+        qp->bind_remote_mr(local_mr);
+        while(qp->connect("localhost",tcp_port) != SUCC) {
+            usleep(2000);
+        }
+        mops = run(qp,payload,total);
+    } else {
+        RCQP *qp = c->create_rc_qp(create_rc_idx(node_id,0),c->get_device(),&local_mr);
+        qp->bind_remote_mr(local_mr);
+        if(type == "rc-wc")
+            qp->enable_write_combining(buffer + buf_size / 4,buf_size / 4);
+        while(qp->connect("localhost",tcp_port) != SUCC) {
+            usleep(2000);
+        }
+        if(type == "rc-tmpl")
+            mops = (payload <= MAX_INLINE_SIZE) ? run_tmpl<IBV_SEND_INLINE>(qp,payload,total) :
+                   run_tmpl<0>(qp,payload,total);
+        else
+            mops = run(qp,payload,total);
+    }
+
+    printf("%s write, payload %d: %f M ops/sec, %f ns/op, %f Gbps\n",
+           type.c_str(),payload,mops,1000.0 / mops,mops * payload * 8 / 1000.0);
+    return 0;
+}
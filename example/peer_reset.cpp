@@ -0,0 +1,77 @@
+#include "rdma_ctrl.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * A loopback check of recovering an RC QP whose peer is passive, i.e., it never posts or polls.
+ * The active QP and the passive QP are connected through the local RdmaCtrl. The active one enables
+ * recovery, and fails with an RDMA write to a bad rkey; its next write recovers it, which resets the
+ * passive QP through the connection handler, and shall complete.
+ *
+ * Usage: ./peer_reset [passive|passive-recovery] [rounds]
+ * passive-recovery enables recovery on the passive QP as well, which is idle.
+ */
+int node_id  = 0;
+int tcp_port = 8888;
+
+const int buf_size = 4096;
+const int mr_id    = 73;
+
+using namespace rdmaio;
+
+int main(int argc, char *argv[])
+{
+    std::string type = argc > 1 ? argv[1] : "passive";
+    int rounds       = argc > 2 ? atoi(argv[2]) : 3;
+
+    RdmaCtrl *c = new RdmaCtrl(node_id,tcp_port);
+    RdmaCtrl::DevIdx idx {.dev_id = 0,.port_id = 1 }; // using the first RNIC's first port
+    c->open_thread_local_device(idx);
+
+    char *buffer = (char *)malloc(buf_size);
+    memset(buffer, 0, buf_size);
+    RDMA_ASSERT(c->register_memory(mr_id,buffer,buf_size,c->get_device()) == true);
+    MemoryAttr local_mr = c->get_local_mr(mr_id);
+
+    // each QP is found by the connection handler with the index given by the other one
+    QPIdx active_idx  = create_rc_idx(node_id,1);
+    QPIdx passive_idx = create_rc_idx(node_id,2);
+    RCQP *active  = c->create_rc_qp(active_idx,c->get_device(),&local_mr);
+    RCQP *passive = c->create_rc_qp(passive_idx,c->get_device(),&local_mr);
+
+    while(active->connect("localhost",tcp_port,passive_idx) != SUCC) {
+        usleep(2000);
+    }
+    while(passive->connect("localhost",tcp_port,active_idx) != SUCC) {
+        usleep(2000);
+    }
+    active->bind_remote_mr(local_mr);
+    active->enable_recovery();
+    if(type == "passive-recovery")
+        passive->enable_recovery();
+
+    MemoryAttr bad_mr = local_mr;
+    bad_mr.key += 1;
+    ibv_wc wc;
+
+    for(int i = 0;i < rounds;++i) {
+        // fail the QPs
+        auto rc = active->post_send_to_mr(local_mr,bad_mr,IBV_WR_RDMA_WRITE,buffer,sizeof(uint64_t),
+                                          0,IBV_SEND_SIGNALED);
+        RDMA_ASSERT(rc == SUCC) << "post bad write error at round " << i;
+        rc = active->poll_till_completion(wc,no_timeout);
+        RDMA_ASSERT(rc == ERR) << "bad write does not fail at round " << i << ": " << rc;
+
+        // recovered before posting
+        *((uint64_t *)buffer) = i + 1;
+        rc = active->post_send(IBV_WR_RDMA_WRITE,buffer,sizeof(uint64_t),buf_size / 2,IBV_SEND_SIGNALED);
+        RDMA_ASSERT(rc == SUCC) << "post after recovery error at round " << i << ": " << rc;
+        rc = active->poll_till_completion(wc);
+        RDMA_ASSERT(rc == SUCC) << "write after recovery does not complete at round " << i << ": " << rc;
+        RDMA_ASSERT(*((uint64_t *)(buffer + buf_size / 2)) == (uint64_t)(i + 1));
+    }
+
+    printf("%s peer: recovered %d times\n",type.c_str(),rounds);
+    return 0;
+}
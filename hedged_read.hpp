@@ -0,0 +1,197 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include "rdma_ctrl.hpp"
+#include "path_monitor.hpp"
+
+/**
+ * Hedged one-sided reads of replicated data.
+ * A read is posted to the first (primary) QP; if it has not completed after the hedge delay,
+ * a duplicate is posted to the next QP, e.g., bound to a replica MR on another peer, and the first
+ * completion wins. The hedge delay is a percentile of the recent latencies of the primary reads, so only
+ * the slowest reads are duplicated. If the hedge wins, the primary's elapsed time is sampled instead, which is
+ * a lower bound of its latency; sampling the winner would drop the slow tail, and lower the delay.
+ *
+ * A read cannot be cancelled once posted, so each QP reads into its own staging slot, and the winner's
+ * slot is copied to the user's buffer. The late read keeps its slot (and the QP) busy until its completion
+ * is polled, which is discarded; busy QPs are skipped when choosing the primary and the hedge.
+ *
+ * The QPs are given in the order of replica preference (e.g., the nearest first): the primary is the first
+ * QP not busy, and the hedge the first one not busy after skipping the primary, so the reads are not
+ * spread across the replicas; the caller shall order (or rotate) the QPs to balance them.
+ * The QPs shall be dedicated to the reader, and bound to MRs with the same layout.
+ * The staging buffer must be inside the local MR of the QPs, and hold max_len bytes per QP.
+ */
+namespace rdmaio {
+
+class HedgedReader {
+ public:
+  static const int      SAMPLE_WINDOW              = 1024;
+  static const uint64_t DEFAULT_MIN_DELAY_NS       = 2000;
+  // the hedge delay before the first window of samples is collected
+  static const uint64_t DEFAULT_INITIAL_DELAY_NS   = 100000;
+  static const uint64_t WR_ID_BASE = 0x4ed6000000000000ULL;
+
+  HedgedReader(const std::vector<RCQP *> &qps,char *staging,uint32_t max_len,
+               double percentile = 0.99,uint64_t min_delay_ns = DEFAULT_MIN_DELAY_NS):
+      qps_(qps),
+      staging_(staging),
+      max_len_(max_len),
+      percentile_(percentile),
+      min_delay_ns_(min_delay_ns),
+      busy_(qps.size(),false),
+      busy_seq_(qps.size(),0),
+      post_ns_(qps.size(),0),
+      samples_(SAMPLE_WINDOW)
+  {
+    RDMA_ASSERT(qps_.size() > 0);
+    RDMA_ASSERT(percentile_ > 0 && percentile_ < 1);
+  }
+
+  /**
+   * Read len bytes at off of the remote MRs.
+   * If winner is given, it is set to the index of the QP whose read completes first.
+   * return ERR if all posted reads fail.
+   */
+  ConnStatus read(uint64_t off,char *buf,uint32_t len,int *winner = nullptr) {
+
+    RDMA_ASSERT(len <= max_len_) << "read of " << len << " bytes exceeds the staging slot";
+    seq_ += 1;
+
+    int primary = pick(-1);
+    if(primary < 0) {
+      // all QPs are busy with late reads
+      primary = 0;
+      wait_late(primary);
+    }
+    if(post(primary,off,len) != SUCC)
+      return ERR;
+    int hedge = -1; // -2 if there is no QP to hedge
+
+    while(true) {
+
+      for(int i : { primary,hedge }) {
+        ibv_wc wc;
+        if(i < 0 || !poll(i,wc))
+          continue;
+        if(wc.status == IBV_WC_SUCCESS) {
+          // the primary's latency, or its elapsed time if it lost
+          sample(PathMonitor::now_ns() - post_ns_[primary]);
+          memcpy(buf,slot(i),len);
+          if(winner != nullptr)
+            *winner = i;
+          hedge_wins_ += (i == hedge);
+          return SUCC;
+        }
+        RDMA_LOG(WARNING) << "hedged read at QP " << i << " error: " << ibv_wc_status_str(wc.status);
+      }
+
+      bool outstanding = busy_[primary] || (hedge >= 0 && busy_[hedge]);
+      // hedge once the delay passes, or at once if the primary fails
+      if(hedge == -1 && (!outstanding || PathMonitor::now_ns() - post_ns_[primary] >= delay_ns_)) {
+        hedge = pick(primary);
+        if(hedge >= 0 && post(hedge,off,len) == SUCC)
+          hedges_ += 1;
+        else
+          hedge = -2;
+        continue;
+      }
+      if(!outstanding)
+        return ERR;
+    }
+  }
+
+  inline uint64_t hedge_delay_ns() const {
+    return delay_ns_;
+  }
+
+  // number of duplicated reads, and the ones completed before the primary
+  inline uint64_t hedges() const {
+    return hedges_;
+  }
+
+  inline uint64_t hedge_wins() const {
+    return hedge_wins_;
+  }
+
+ private:
+  std::vector<RCQP *> qps_;
+  char *staging_;
+  const uint32_t max_len_;
+  const double   percentile_;
+  const uint64_t min_delay_ns_;
+
+  // whether a read of the QP is outstanding, and the sequence of the read() posting it
+  std::vector<bool>     busy_;
+  std::vector<uint64_t> busy_seq_;
+  std::vector<uint64_t> post_ns_;
+  uint64_t seq_ = 0;
+
+  std::vector<uint64_t> samples_;
+  uint64_t sample_count_ = 0;
+  uint64_t delay_ns_     = DEFAULT_INITIAL_DELAY_NS;
+
+  uint64_t hedges_     = 0;
+  uint64_t hedge_wins_ = 0;
+
+  inline char *slot(int i) {
+    return staging_ + (uint64_t)i * max_len_;
+  }
+
+  ConnStatus post(int i,uint64_t off,uint32_t len) {
+    post_ns_[i] = PathMonitor::now_ns();
+    auto ret = qps_[i]->post_send(IBV_WR_RDMA_READ,slot(i),len,off,IBV_SEND_SIGNALED,WR_ID_BASE | seq_);
+    if(ret == SUCC) {
+      busy_[i]     = true;
+      busy_seq_[i] = seq_;
+    }
+    return ret;
+  }
+
+  /**
+   * Poll the outstanding read of the QP.
+   * return true if the read of the current read() completes; late ones are discarded.
+   */
+  bool poll(int i,ibv_wc &wc) {
+    while(busy_[i] && ibv_poll_cq(qps_[i]->cq_,1,&wc) == 1) {
+      RDMA_ASSERT((wc.wr_id & ~0xffffffffffffULL) == WR_ID_BASE) << "QP is shared with other requests";
+      busy_[i] = false;
+      if(busy_seq_[i] == seq_)
+        return true;
+    }
+    return false;
+  }
+
+  void wait_late(int i) {
+    ibv_wc wc;
+    while(busy_[i])
+      poll(i,wc);
+  }
+
+  // the first QP not busy in the order of preference, except the excluded one
+  int pick(int exclude) {
+    ibv_wc wc;
+    for(int i = 0;i < (int)qps_.size();++i) {
+      if(i == exclude)
+        continue;
+      poll(i,wc);
+      if(!busy_[i])
+        return i;
+    }
+    return -1;
+  }
+
+  void sample(uint64_t ns) {
+    samples_[sample_count_++ % SAMPLE_WINDOW] = ns;
+    if(sample_count_ % SAMPLE_WINDOW != 0)
+      return;
+    std::vector<uint64_t> sorted(samples_);
+    auto nth = sorted.begin() + (size_t)(percentile_ * (SAMPLE_WINDOW - 1));
+    std::nth_element(sorted.begin(),nth,sorted.end());
+    delay_ns_ = std::max(*nth,min_delay_ns_);
+  }
+};
+
+} // namespace rdmaio
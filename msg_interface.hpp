@@ -95,6 +95,13 @@ class MsgAdapter {
     return 0;
   }
 
+  /**
+   * Feed an RTT sample to the node, measured by the layer above;
+   * used by adapters with congestion control (UDAdapter), and ignored by default.
+   */
+  virtual void rtt_sample(int /*node_id*/,uint64_t /*rtt_ns*/) {
+  }
+
  protected:
   msg_callback_t_ callback_;
 };
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <time.h>
+#include <algorithm>
+#include <cstdint>
+
+namespace rdmaio {
+
+/**
+ * A token bucket which paces the bytes posted to a QP.
+ * Tokens (bytes) are refilled at rate bytes per second, up to burst bytes.
+ * It is used for bulk traffic, so that it cannot occupy the RNIC & the fabric queues
+ * for long, which inflates the tail latency of small requests.
+ * A request is always charged its full length: one larger than the burst waits for a full bucket,
+ * and leaves the bucket in debt, which the following requests wait to be paid back.
+ */
+class TokenBucket {
+ public:
+  TokenBucket(uint64_t bytes_per_sec,uint64_t burst):
+      rate_(bytes_per_sec),
+      burst_(burst),
+      tokens_((int64_t)burst),
+      last_ns_(now_ns())
+  {
+  }
+
+  /**
+   * Take len bytes of tokens, waiting until they are available.
+   * A request larger than the burst waits for a full bucket, and puts it in debt.
+   */
+  void consume(uint64_t len) {
+    uint64_t need = std::min(len,burst_);
+    while(!try_consume(need,len))
+      asm volatile("pause" ::: "memory");
+  }
+
+  // the tokens accumulated so far are kept
+  void set_rate(uint64_t bytes_per_sec) {
+    rate_ = bytes_per_sec;
+  }
+
+  inline uint64_t rate() const {
+    return rate_;
+  }
+
+  /**
+   * return false if there are not enough tokens yet
+   */
+  bool try_consume(uint64_t len) {
+    return try_consume(std::min(len,burst_),len);
+  }
+
+ private:
+  uint64_t rate_;
+  const uint64_t burst_;
+
+  int64_t  tokens_;  // negative if in debt
+  uint64_t last_ns_;
+
+  static inline uint64_t now_ns() {
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+  inline bool try_consume(uint64_t need,uint64_t len) {
+    if(tokens_ < (int64_t)need) {
+      uint64_t now = now_ns();
+      // at most one second is counted, which avoids the overflow after a long idle
+      uint64_t refill = std::min<uint64_t>(now - last_ns_,1000000000ULL) * rate_ / 1000000000ULL;
+      if(refill == 0)
+        return false;
+      tokens_  = std::min((int64_t)burst_,tokens_ + (int64_t)refill);
+      last_ns_ = now;
+      if(tokens_ < (int64_t)need)
+        return false;
+    }
+    tokens_ -= (int64_t)len;
+    return true;
+  }
+};
+
+} // namespace rdmaio
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <time.h>
+#include <cstdint>
+#include <limits>
+
+namespace rdmaio {
+
+/**
+ * Detect the latency degradation of a QP's path.
+ * Latency samples are averaged in windows; the best window average is the baseline of the path.
+ * The path is degraded if a window average exceeds degrade_factor times the baseline,
+ * e.g., the path is congested by other flows hashed onto it.
+ */
+class PathMonitor {
+ public:
+  static const int DEFAULT_WINDOW = 256;
+
+  PathMonitor(double degrade_factor,int window = DEFAULT_WINDOW):
+      degrade_factor_(degrade_factor),
+      window_(window)
+  {
+  }
+
+  /**
+   * Add a latency sample (in nanoseconds).
+   * return true if the path is degraded, so the QP shall be moved to another path.
+   */
+  bool sample(uint64_t ns) {
+    sum_ += ns;
+    if(++count_ < window_)
+      return false;
+
+    uint64_t avg = sum_ / count_;
+    sum_ = 0; count_ = 0;
+
+    // the first window after moving to a new path is not counted
+    if(skip_window_) {
+      skip_window_ = false;
+      return false;
+    }
+    if(avg < baseline_) {
+      baseline_ = avg;
+      return false;
+    }
+    return avg > degrade_factor_ * baseline_;
+  }
+
+  /**
+   * Called once the QP is moved to another path
+   */
+  void on_rehash() {
+    sum_ = 0; count_ = 0;
+    skip_window_ = true;
+    rehashes_ += 1;
+  }
+
+  inline uint64_t rehashes() const {
+    return rehashes_;
+  }
+
+  static inline uint64_t now_ns() {
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+ private:
+  const double degrade_factor_;
+  const int    window_;
+
+  uint64_t sum_      = 0;
+  int      count_    = 0;
+  uint64_t baseline_ = std::numeric_limits<uint64_t>::max();
+  bool     skip_window_ = false;
+  uint64_t rehashes_ = 0;
+};
+
+} // namespace rdmaio
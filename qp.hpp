@@ -1,7 +1,18 @@
 #pragma once
 
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
 #include "common.hpp"
 #include "qp_impl.hpp" // hide the implementation
+#include "write_combiner.hpp"
+#include "staging.hpp"
+#include "recovery.hpp"
+#include "pacer.hpp"
+#include "path_monitor.hpp"
 
 namespace rdmaio {
 
@@ -122,7 +133,9 @@ inline constexpr RCConfig default_rc_config() {
     .max_dest_rd_atomic = 16,
     .rq_psn             = DEFAULT_PSN,
     .sq_psn             = DEFAULT_PSN,
-    .timeout            = 20
+    .timeout            = 20,
+    .sl                 = 0,
+    .traffic_class      = 0
   };
 }
 
@@ -148,6 +161,21 @@ class RRCQP : public QP {
       :QP(rnic,idx)
   {
     RCQPImpl::init<F>(qp_,cq_,rnic_);
+    init_templates();
+  }
+
+  /**
+   * Create a QP whose receives are taken from a shared receive queue.
+   * The srq & recv_cq are owned by the caller, and can be shared by many QPs.
+   */
+  RRCQP(RNicHandler *rnic,QPIdx idx,MemoryAttr local_mr,ibv_cq *recv_cq,ibv_srq *srq)
+      :QP(rnic,idx),
+       recv_cq_(recv_cq),
+       srq_(srq)
+  {
+    RCQPImpl::init<F>(qp_,cq_,rnic_,recv_cq_,srq_);
+    init_templates();
+    bind_local_mr(local_mr);
   }
 
   ConnStatus connect(std::string ip,int port) {
@@ -167,27 +195,46 @@ class RRCQP : public QP {
     arg.type = ConnArg::QP;
     arg.payload.qp.from_node   = idx.node_id;
     arg.payload.qp.from_worker = idx.worker_id;
+    arg.payload.qp.from_index  = idx.index;
     arg.payload.qp.qp_type     = IBV_QPT_RC;
 
     auto ret = QPImpl::get_remote_helper(&arg,&reply,ip,port);
     if(ret == SUCC) {
-      // change QP status
-      if(!RCQPImpl::ready2rcv<F>(qp_,reply.payload.qp,rnic_)) {
-        RDMA_LOG(WARNING) << "change qp status to ready to receive error: " << strerror(errno);
-        ret = ERR;
-        goto CONN_END;
-      }
-
-      if(!RCQPImpl::ready2send<F>(qp_)) {
-        RDMA_LOG(WARNING) << "change qp status to ready to send error: " << strerror(errno);
-        ret = ERR;
-        goto CONN_END;
-      }
+      ret = connect(reply.payload.qp);
+    }
+    if(ret == SUCC) {
+      // used to reconnect upon recovery
+      peer_ip_   = ip;
+      peer_port_ = port;
+      peer_idx_  = idx;
     }
- CONN_END:
     return ret;
   }
 
+  /**
+   * Change the QP to ready-to-send, using the remote QP's attribute which has already been fetched.
+   */
+  ConnStatus connect(QPAttr &remote_attr) {
+
+    enum ibv_qp_state state;
+    if( (state = QPImpl::query_qp_status(qp_)) != IBV_QPS_INIT) {
+      return (state == IBV_QPS_RTS)?SUCC:UNKNOWN;
+    }
+
+    // QPs between the same hosts use distinct flow labels, so they are spread over the paths
+    flow_label_ = compute_flow_label(qp_->qp_num,remote_attr.qpn,path_salt_);
+    if(!RCQPImpl::ready2rcv<F>(qp_,remote_attr,rnic_,flow_label_)) {
+      RDMA_LOG(WARNING) << "change qp status to ready to receive error: " << strerror(errno);
+      return ERR;
+    }
+
+    if(!RCQPImpl::ready2send<F>(qp_)) {
+      RDMA_LOG(WARNING) << "change qp status to ready to send error: " << strerror(errno);
+      return ERR;
+    }
+    return SUCC;
+  }
+
   /**
    * Bind this QP's operation to a remote memory region according to the MemoryAttr.
    * Since usually one QP access *one memory region* almost all the time,
@@ -202,6 +249,15 @@ class RRCQP : public QP {
                              uint64_t wr_id = 0, uint32_t imm = 0) {
     ConnStatus ret = SUCC;
     struct ibv_send_wr *bad_sr;
+    auto owner = lock_owner();
+
+    if(combiner_ != nullptr && combine_write(remote_mr,op,local_buf,len,off,flags,ret))
+      return ret;
+
+    if(unlikely(pacer_ != nullptr))
+      pacer_->consume(len);
+    if(unlikely(monitor_ != nullptr) && (flags & IBV_SEND_SIGNALED))
+      signaled_start_ns_ = PathMonitor::now_ns();
 
     // setting the SGE
     struct ibv_sge sge {
@@ -223,6 +279,8 @@ class RRCQP : public QP {
     sr.wr.rdma.remote_addr = remote_mr.buf + off;
     sr.wr.rdma.rkey        = remote_mr.key;
 
+    if(unlikely(recovery_ != nullptr))
+      return post_recorded(&sr);
     auto rc = ibv_post_send(qp_,&sr,&bad_sr);
     return rc == 0 ? SUCC : ERR;
   }
@@ -236,6 +294,36 @@ class RRCQP : public QP {
     return post_send_to_mr(local_mr_,remote_mr_,op,local_buf,len,off,flags,wr_id,imm);
   }
 
+  /**
+   * Post a request using the pre-built request of this QP, to the local & remote MR bound to this QP.
+   * The opcode & flags are decided at compile time, so only the addresses, length and keys are filled
+   * before ringing the doorbell.
+   */
+  template <ibv_wr_opcode op,int flags = 0>
+  inline __attribute__ ((always_inline))
+  ConnStatus post(char *local_buf,uint32_t len,uint64_t off,uint64_t wr_id = 0) {
+    static_assert(op == IBV_WR_RDMA_WRITE || op == IBV_WR_RDMA_READ || op == IBV_WR_SEND,
+                  "use post_atomic for atomics, or post_send for requests with imm.");
+
+    if(unlikely(slow_path_))
+      return post_send(op,local_buf,len,off,flags,wr_id);
+
+    struct ibv_send_wr *bad_sr;
+
+    sge_tmpl_.addr   = (uint64_t)local_buf;
+    sge_tmpl_.length = len;
+    sge_tmpl_.lkey   = local_mr_.key;
+
+    sr_tmpl_.wr_id      = wr_id;
+    sr_tmpl_.opcode     = op;
+    sr_tmpl_.send_flags = flags;
+    sr_tmpl_.wr.rdma.remote_addr = remote_mr_.buf + off;
+    sr_tmpl_.wr.rdma.rkey        = remote_mr_.key;
+
+    auto rc = ibv_post_send(qp_,&sr_tmpl_,&bad_sr);
+    return rc == 0 ? SUCC : ERR;
+  }
+
   // one-sided atomic operations
   ConnStatus post_cas(char *local_buf,uint64_t off,
                       uint64_t compare,uint64_t swap,int flags,uint64_t wr_id = 0) {
@@ -257,61 +345,784 @@ class RRCQP : public QP {
     if((off & 0x7) != 0) {
       return WRONG_ARG;
     }
+    auto owner = lock_owner();
+
+    if(combiner_ != nullptr) {
+      auto ret = flush_writes();
+      if(ret != SUCC)
+        return ret;
+    }
 
-    ConnStatus ret = SUCC;
     struct ibv_send_wr *bad_sr;
 
-    // setting the SGE
+    // the atomic request is pre-built, except the addresses & values
+    atomic_sge_tmpl_.addr = (uint64_t)local_buf;
+    atomic_sge_tmpl_.lkey = local_mr_.key;
+
+    atomic_sr_tmpl_.wr_id        = wr_id;
+    atomic_sr_tmpl_.opcode       = type;
+    atomic_sr_tmpl_.send_flags   = flags;
+    // remote memory
+    atomic_sr_tmpl_.wr.atomic.rkey          = remote_mr_.key;
+    atomic_sr_tmpl_.wr.atomic.remote_addr   = (off + remote_mr_.buf);
+    atomic_sr_tmpl_.wr.atomic.compare_add   = compare;
+    atomic_sr_tmpl_.wr.atomic.swap          = swap;
+
+    if(unlikely(recovery_ != nullptr))
+      return post_recorded(&atomic_sr_tmpl_);
+    auto rc = ibv_post_send(qp_,&atomic_sr_tmpl_,&bad_sr);
+    return rc == 0 ? SUCC : ERR;
+  }
+
+  ConnStatus post_batch(struct ibv_send_wr *send_sr,ibv_send_wr **bad_sr_addr,int /*num*/ = 0) {
+    auto owner = lock_owner();
+    if(combiner_ != nullptr) {
+      auto ret = flush_writes();
+      if(ret != SUCC)
+        return ret;
+    }
+    if(recovery_ != nullptr)
+      return post_recorded(send_sr,bad_sr_addr);
+    auto rc = ibv_post_send(qp_,send_sr,bad_sr_addr);
+    return rc == 0 ? SUCC : ERR;
+  }
+
+  /**
+   * Opt-in write combining.
+   * Afterwards, small unsignaled RDMA writes posted to this QP to contiguous or overlapping remote ranges
+   * are merged into one write, until window_size bytes are merged, or the first one has been delayed for window_us.
+   * Signaled writes, atomics, sends, batches, reads to the merged range and polls flush the merged writes first.
+   * The window is only checked when the QP is used, so merged writes on an idle QP are not posted until
+   * the next post or poll; the caller shall poll the QP (poll_send_completion), or call flush_writes.
+   * The staging buffer must be inside the local MR of this QP.
+   */
+  void enable_write_combining(char *staging,uint32_t staging_size,
+                              uint32_t window_size = WriteCombiner::DEFAULT_WINDOW_SIZE,
+                              uint32_t window_us   = WriteCombiner::DEFAULT_WINDOW_US) {
+    combiner_.reset(new WriteCombiner(staging,staging_size,window_size,window_us));
+    slow_path_ = true;
+  }
+
+  /**
+   * Post the pending merged writes; a barrier of write combining.
+   * Once a half of the staging buffer is full, it waits for the writes from the other half to complete;
+   * return TIMEOUT if they do not complete within the timeout, or ERR if the QP fails meanwhile.
+   */
+  ConnStatus flush_writes(struct timeval timeout = default_timeout) {
+
+    if(combiner_ == nullptr || combiner_->empty())
+      return SUCC;
+
+    auto owner = lock_owner();
+    auto run = combiner_->take();
+    struct ibv_send_wr *bad_sr;
+
     struct ibv_sge sge {
-      .addr = (uint64_t)local_buf,
-          .length = sizeof(uint64_t), // atomic only supports 8-byte operation
+      .addr = (uint64_t)run.buf,
+          .length = run.len,
           .lkey   = local_mr_.key
           };
 
     struct ibv_send_wr sr;
-    sr.wr_id        = wr_id;
-    sr.opcode       = type;
+    sr.wr_id        = run.wr_id;
+    sr.opcode       = IBV_WR_RDMA_WRITE;
     sr.num_sge      = 1;
     sr.next         = NULL;
     sr.sg_list      = &sge;
-    sr.send_flags   = flags;
-    // remote memory
-    sr.wr.atomic.rkey          = remote_mr_.key;
-    sr.wr.atomic.remote_addr   = (off + remote_mr_.buf);
-	sr.wr.atomic.compare_add   = compare;
-	sr.wr.atomic.swap          = swap;
+    sr.send_flags   = (run.signaled ? IBV_SEND_SIGNALED : 0) | ((run.len < MAX_INLINE_SIZE) ? IBV_SEND_INLINE : 0);
 
-    auto rc = ibv_post_send(qp_,&sr,&bad_sr);
-    return rc == 0 ? SUCC : ERR;
+    sr.wr.rdma.remote_addr = run.remote_mr.buf + run.off;
+    sr.wr.rdma.rkey        = run.remote_mr.key;
+
+    auto rc = (recovery_ != nullptr) ? (post_recorded(&sr) == SUCC ? 0 : -1) : ibv_post_send(qp_,&sr,&bad_sr);
+
+    if(rc != 0) {
+      combiner_->cancel(run);
+      return ERR;
+    }
+
+    // wait for the next half of the staging buffer
+    struct timeval start_time; gettimeofday(&start_time,nullptr);
+    while(combiner_->half_busy()) {
+      if(recovery_ != nullptr && recovery_->failed())
+        return ERR;  // the flushed writes are not passed to the combiner; recovered by the next post or poll
+      if(reap_completion() < 0)
+        return ERR;
+      struct timeval cur_time; gettimeofday(&cur_time,nullptr);
+      if(diff_time(cur_time,start_time) > timeout.tv_sec * 1000 + timeout.tv_usec)
+        return TIMEOUT;
+    }
+    return SUCC;
   }
 
-  ConnStatus post_batch(struct ibv_send_wr *send_sr,ibv_send_wr **bad_sr_addr,int num = 0) {
-    auto rc = ibv_post_send(qp_,send_sr,bad_sr_addr);
-    return rc == 0 ? SUCC : ERR;
+  /**
+   * Post a request whose local buffer needs not to be inside the local MR.
+   * Inlined payloads are posted directly. Otherwise payloads no larger than StagingPool::MAX_STAGED_SIZE
+   * are copied to the thread's registered staging buffers (for reads, the data is copied back
+   * once the completion is polled), and larger ones are registered on the fly.
+   * The staging buffer, or the registration, is released once the request completes;
+   * the completion is returned to the user only if the request is signaled.
+   * The staging buffers are the ones of the thread posting first, so afterwards the QP shall be posted
+   * and polled by that thread only.
+   */
+  ConnStatus post_send_from(ibv_wr_opcode op,char *buf,uint32_t len,uint64_t off,int flags,
+                            uint64_t wr_id = 0, uint32_t imm = 0) {
+
+    if(op != IBV_WR_RDMA_READ && len < MAX_INLINE_SIZE)
+      return post_send_to_mr(local_mr_,remote_mr_,op,buf,len,off,flags | IBV_SEND_INLINE,wr_id,imm);
+
+    auto owner = lock_owner();
+    if(stager_ == nullptr)
+      stager_.reset(new StagedRequests(StagingPool::thread_local_pool(rnic_),RCQPImpl::RC_MAX_SEND_SIZE));
+
+    char *local_buf; MemoryAttr local_mr = {}; uint64_t staged_wr_id;
+    ConnStatus ret;
+    while((ret = stager_->stage(op,buf,len,flags,wr_id,local_buf,local_mr.key,staged_wr_id)) == NOT_READY) {
+      // no staging buffer available, wait for previous staged requests
+      if(stager_->inflight() == 0 || reap_completion() < 0)
+        return ERR;
+    }
+    if(ret != SUCC)
+      return ret;
+
+    ret = post_send_to_mr(local_mr,remote_mr_,op,local_buf,len,off,flags | IBV_SEND_SIGNALED,staged_wr_id,imm);
+    if(ret != SUCC)
+      stager_->cancel(staged_wr_id);
+    return ret;
   }
 
   /**
    * Poll completions. These are just wrappers of ibv_poll_cq
    */
   int poll_send_completion(ibv_wc &wc) {
+    if(combiner_ != nullptr || stager_ != nullptr || recovery_ != nullptr) {
+      auto owner = lock_owner();
+      if(flush_writes() != SUCC) {
+        RDMA_LOG(WARNING) << "flush merged writes error";
+        return -1;
+      }
+      if(!stashed_wcs_.empty()) {
+        wc = stashed_wcs_.front();
+        stashed_wcs_.pop_front();
+        return 1;
+      }
+      int n;
+      while((n = ibv_poll_cq(cq_,1,&wc)) > 0 && internal_completion(wc));
+      return n;
+    }
     return ibv_poll_cq(cq_,1,&wc);
   }
 
   ConnStatus poll_till_completion(ibv_wc &wc,struct timeval timeout = default_timeout) {
-    auto ret = QP::poll_till_completion(wc,timeout);
+    ConnStatus ret;
+    auto owner = lock_owner();
+    if(combiner_ != nullptr || stager_ != nullptr || recovery_ != nullptr) {
+      if((ret = flush_writes()) != SUCC)
+        return ret;
+      if(!stashed_wcs_.empty()) {
+        wc = stashed_wcs_.front();
+        stashed_wcs_.pop_front();
+        ret = (wc.status == IBV_WC_SUCCESS) ? SUCC : ERR;
+      } else {
+        while((ret = QP::poll_till_completion(wc,timeout)) != TIMEOUT && internal_completion(wc));
+      }
+      // the QP may fail without any completion, e.g., reset by the peer
+      if(ret == TIMEOUT && recovery_ != nullptr && (need_recovery() || check_async_events()) &&
+         (ret = recover()) == SUCC) {
+        if(!stashed_wcs_.empty()) {
+          wc = stashed_wcs_.front();
+          stashed_wcs_.pop_front();
+          ret = (wc.status == IBV_WC_SUCCESS) ? SUCC : ERR;
+        } else {
+          // wait for the replayed requests; NOT_READY if nothing completes, though the QP is recovered
+          while((ret = QP::poll_till_completion(wc,timeout)) != TIMEOUT && internal_completion(wc));
+          if(ret == TIMEOUT)
+            ret = NOT_READY;
+        }
+      }
+    } else
+      ret = QP::poll_till_completion(wc,timeout);
     if(ret == SUCC) {
       low_watermark_ = high_watermark_;
+      if(unlikely(monitor_ != nullptr) && signaled_start_ns_ != 0) {
+        bool degraded = monitor_->sample(PathMonitor::now_ns() - signaled_start_ns_);
+        signaled_start_ns_ = 0;
+        if(degraded)
+          rehash();
+      }
     }
     return ret;
   }
 
+  /**
+   * Opt-in pacing, for QPs carrying bulk traffic.
+   * Afterwards, posting a request waits until the token bucket has enough tokens for its payload,
+   * so the QP sends at most bytes_per_sec bytes per second, with bursts up to burst bytes.
+   */
+  void enable_pacing(uint64_t bytes_per_sec,uint64_t burst = 64 * 1024) {
+    pacer_.reset(new TokenBucket(bytes_per_sec,burst));
+    slow_path_ = true;
+  }
+
+  /**
+   * Opt-in path monitoring.
+   * Afterwards, the latency of signaled requests (from posting to poll_till_completion) is monitored,
+   * and the QP is moved to another path (rehash) once its latency exceeds degrade_factor times the best seen.
+   * Rehashing reconnects the QP through recovery (enabled if it is not), after the QP is quiesced,
+   * so no request is replayed or failed. It blocks the caller for the reconnection handshake,
+   * and resets the peer's QP as well, so the peer shall enable recovery to handle its outstanding requests.
+   */
+  void enable_path_monitor(double degrade_factor = 2.0,int window = PathMonitor::DEFAULT_WINDOW) {
+    if(recovery_ == nullptr)
+      enable_recovery(FAIL_OUTSTANDING);
+    monitor_.reset(new PathMonitor(degrade_factor,window));
+    slow_path_ = true;
+  }
+
+  /**
+   * Move the QP to another ECMP path, by reconnecting it with a new flow label.
+   * The outstanding requests are waited for first, so a healthy QP is reconnected with nothing to replay.
+   */
+  ConnStatus rehash() {
+    RDMA_ASSERT(recovery_ != nullptr) << "rehash requires recovery";
+    auto owner = lock_owner();
+    auto ret = quiesce();
+    if(ret != SUCC)
+      return ret;
+    path_salt_ += 1;
+    ret = recover();
+    if(ret == SUCC && monitor_ != nullptr)
+      monitor_->on_rehash();
+    return ret;
+  }
+
+  inline uint32_t flow_label() const {
+    return flow_label_;
+  }
+
+  /**
+   * Opt-in automatic recovery.
+   * Afterwards, once the QP fails (an error completion is polled, the RNIC reports a fatal async event,
+   * or the peer resets the QP), the next post recovers it with recover() before posting.
+   * The outstanding requests are then failed or replayed according to the policy.
+   * It requires the QP to be connected with connect(ip,port), so the peer is known.
+   *
+   * Both sides take part in the recovery: the peer's QP is reset by the connection handler of the peer's
+   * RdmaCtrl (reset_by_peer), at once if its owner is idle or has not enabled recovery, e.g., a passive
+   * side which never posts; otherwise by its owner at the next post or poll, while this side retries.
+   * With recovery enabled, the owner holds a lock of the QP while posting or polling, so the handler
+   * knows whether it is idle.
+   */
+  void enable_recovery(RecoveryPolicy policy = FAIL_OUTSTANDING) {
+    recovery_.reset(new RecoveryLog(policy,RCQPImpl::RC_MAX_SEND_SIZE));
+    slow_path_ = true;
+  }
+
+  bool need_recovery() {
+    return recovery_ != nullptr &&
+        (recovery_->failed() || async_failed_ || peer_resets_.load() != seen_peer_resets_);
+  }
+
+  /**
+   * Check the RNIC's async events, which are not cheap, so it is only checked when the QP seems stuck
+   */
+  bool check_async_events() {
+    if(rnic_->qp_failed(qp_->qp_num))
+      async_failed_ = true;
+    return async_failed_;
+  }
+
+  /**
+   * Reset the QP, and connect it to the peer again (RESET -> INIT -> RTR -> RTS).
+   * The peer's QP is reset through the control channel first, so both sides start from the initial PSN.
+   * If the peer is recovering at the same time, only one side drives the handshake.
+   * If the peer has reset its QP (reset_by_peer), the QP is reconnected to the recorded attr instead.
+   */
+  ConnStatus recover(struct timeval timeout = default_timeout) {
+
+    if(peer_port_ == 0 && peer_resets_.load() == seen_peer_resets_) {
+      RDMA_LOG(WARNING) << "recover a qp whose peer is unknown";
+      return WRONG_ARG;
+    }
+    auto owner = lock_owner();
+    recovering_.store(true);
+    reset_round_ = (reset_round_ % 255) + 1;
+
+    // the completions already generated, including the flushed ones
+    ibv_wc wc;
+    while(ibv_poll_cq(cq_,1,&wc) > 0) {
+      if(!internal_completion(wc))
+        stashed_wcs_.push_back(wc);
+    }
+
+    struct timeval start_time; gettimeofday(&start_time,nullptr);
+    ConnStatus ret = NOT_READY;
+    while(peer_resets_.load() == seen_peer_resets_) {
+
+      ConnArg arg = {} ; ConnReply reply = {};
+      arg.type = ConnArg::QP;
+      arg.payload.qp.from_node   = peer_idx_.node_id;
+      arg.payload.qp.from_worker = peer_idx_.worker_id;
+      arg.payload.qp.from_index  = peer_idx_.index;
+      arg.payload.qp.qp_type     = IBV_QPT_RC;
+      arg.payload.qp.reset       = reset_round_;
+      arg.payload.qp.attr        = get_attr();
+
+      ret = QPImpl::get_remote_helper(&arg,&reply,peer_ip_,peer_port_);
+      if(ret == SUCC) {
+        ret = reset_and_connect(reply.payload.qp);
+        break;
+      }
+      struct timeval cur_time; gettimeofday(&cur_time,nullptr);
+      if(ret != NOT_READY || diff_time(cur_time,start_time) > timeout.tv_sec * 1000 + timeout.tv_usec)
+        break;
+      usleep(100); // the peer is recovering, and will reset us
+    }
+    if(peer_resets_.load() != seen_peer_resets_) {
+      QPAttr attr; uint8_t round;
+      {
+        std::lock_guard<std::mutex> guard(peer_lock_);
+        seen_peer_resets_ = peer_resets_.load();
+        attr  = peer_reset_attr_;
+        round = peer_reset_round_;
+      }
+      ret = reset_and_connect(attr);
+      std::lock_guard<std::mutex> guard(peer_lock_);
+      peer_reset_done_ = (ret == SUCC) && round == peer_reset_round_ && same_qp(attr,peer_reset_attr_);
+    }
+    recovering_.store(false);
+
+    if(ret != SUCC) {
+      RDMA_LOG(WARNING) << "recover qp to " << peer_ip_ << ":" << peer_port_ << " error: " << ret;
+      return ret;
+    }
+    async_failed_  = false;
+    low_watermark_ = high_watermark_;
+
+    // handle the outstanding requests
+    auto outstanding = recovery_ != nullptr ? recovery_->take_outstanding() : std::vector<RecoveryLog::Entry>();
+    for(auto &e : outstanding) {
+      if(recovery_->policy() == REPLAY_OUTSTANDING) {
+        e.sr.sg_list = &e.sge;
+        if(post_recorded(&e.sr) != SUCC) {
+          RDMA_LOG(WARNING) << "replay request error: " << strerror(errno);
+          return ERR;
+        }
+      } else if(e.sr.send_flags & IBV_SEND_SIGNALED) {
+        ibv_wc flushed = {};
+        flushed.wr_id  = e.sr.wr_id;
+        flushed.status = IBV_WC_WR_FLUSH_ERR;
+        flushed.qp_num = qp_->qp_num;
+        if(!internal_completion(flushed))
+          stashed_wcs_.push_back(flushed);
+      }
+    }
+    return SUCC;
+  }
+
+  /**
+   * Called by the connection handler, once the peer recovers its QP; the QP is reset & connected to remote_attr.
+   * It is done here if the owner is idle, or has not enabled recovery (then the owner's posts fail until
+   * the reset completes, as they do while the QP is in error). Otherwise the attr is recorded, and the owner
+   * resets the QP in recover() at its next post or poll (see need_recovery).
+   * return NOT_READY if the QP has not been reset yet, so the peer retries; or if this QP is recovering
+   * at the same time, and it drives the handshake.
+   */
+  ConnStatus reset_by_peer(QPAttr &remote_attr,uint8_t round) {
+    if(recovering_.load()) {
+      auto local_attr = get_attr();
+      bool peer_drives = (remote_attr.qpn < local_attr.qpn) ||
+                         (remote_attr.qpn == local_attr.qpn && remote_attr.addr.interface_id < local_attr.addr.interface_id);
+      if(!peer_drives)
+        return NOT_READY;
+    }
+    {
+      std::lock_guard<std::mutex> guard(peer_lock_);
+      // a retry of the reset which has been done by the owner
+      if(peer_reset_done_ && round == peer_reset_round_ && same_qp(remote_attr,peer_reset_attr_))
+        return SUCC;
+      peer_reset_attr_  = remote_attr;
+      peer_reset_round_ = round;
+      peer_reset_done_  = false;
+      if(recovery_ == nullptr) {
+        auto ret = reset_and_connect(remote_attr);
+        peer_reset_done_ = (ret == SUCC);
+        return ret;
+      }
+      if(peer_resets_.load() == seen_peer_resets_)
+        peer_resets_.fetch_add(1);
+    }
+    std::unique_lock<std::recursive_mutex> owner(owner_lock_,std::try_to_lock);
+    if(!owner.owns_lock())
+      return NOT_READY;
+    return recover();
+  }
+
   /**
    * Used to count pending reqs
    * XD: current we use 64 as default, but it is rather application defined,
    * which is related to how the QP's send to are created, etc
    */
   bool need_poll(int threshold = (RCQPImpl::RC_MAX_SEND_SIZE / 2)) {
-    return (high_watermark_ - low_watermark_) >= threshold;
+    return (high_watermark_ - low_watermark_) >= (uint64_t)threshold;
+  }
+
+  uint64_t high_watermark_ = 0;
+  uint64_t low_watermark_  = 0;
+
+  MemoryAttr remote_mr_;
+
+  // receive structures shared with other QPs, if any
+  ibv_cq  *recv_cq_ = nullptr;
+  ibv_srq *srq_     = nullptr;
+
+ private:
+  std::unique_ptr<WriteCombiner>  combiner_;
+  std::unique_ptr<StagedRequests> stager_;
+  std::unique_ptr<TokenBucket>    pacer_;
+  std::unique_ptr<PathMonitor>    monitor_;
+
+  // any opt-in feature above is enabled, so the requests cannot bypass post_send_to_mr
+  bool slow_path_ = false;
+
+  uint32_t flow_label_ = 0;
+  uint32_t path_salt_  = 0;
+  uint64_t signaled_start_ns_ = 0;
+
+  // pre-built requests, the fields which never change are filled at creation
+  struct ibv_send_wr sr_tmpl_;
+  struct ibv_sge     sge_tmpl_;
+  struct ibv_send_wr atomic_sr_tmpl_;
+  struct ibv_sge     atomic_sge_tmpl_;
+
+  void init_templates() {
+    memset(&sr_tmpl_,0,sizeof(sr_tmpl_));
+    memset(&sge_tmpl_,0,sizeof(sge_tmpl_));
+    sr_tmpl_.num_sge  = 1;
+    sr_tmpl_.next     = NULL;
+    sr_tmpl_.sg_list  = &sge_tmpl_;
+
+    memset(&atomic_sr_tmpl_,0,sizeof(atomic_sr_tmpl_));
+    memset(&atomic_sge_tmpl_,0,sizeof(atomic_sge_tmpl_));
+    atomic_sge_tmpl_.length = sizeof(uint64_t); // atomic only supports 8-byte operation
+    atomic_sr_tmpl_.num_sge = 1;
+    atomic_sr_tmpl_.next    = NULL;
+    atomic_sr_tmpl_.sg_list = &atomic_sge_tmpl_;
+  }
+
+  // user completions polled while waiting for internal ones
+  std::deque<ibv_wc> stashed_wcs_;
+
+  // states for recovery
+  std::unique_ptr<RecoveryLog> recovery_;
+  std::string peer_ip_;
+  int         peer_port_ = 0;
+  QPIdx       peer_idx_;
+  bool        async_failed_ = false;
+  std::atomic<bool>     recovering_{false};
+  std::atomic<uint64_t> peer_resets_{0}; // modified by the connection handler
+  uint64_t              seen_peer_resets_ = 0;
+  std::mutex            peer_lock_;       // protects the attr recorded by the connection handler
+  QPAttr                peer_reset_attr_;
+  uint8_t               peer_reset_round_ = 0;
+  bool                  peer_reset_done_  = false;  // whether the recorded reset has been done
+  uint8_t               reset_round_      = 0;      // my recovery round, sent to the peer
+  std::recursive_mutex  owner_lock_;      // held by the owner while using the QP, if recovery is enabled
+
+  inline std::unique_lock<std::recursive_mutex> lock_owner() {
+    if(recovery_ == nullptr)
+      return std::unique_lock<std::recursive_mutex>();
+    return std::unique_lock<std::recursive_mutex>(owner_lock_);
+  }
+
+  static bool same_qp(const QPAttr &a,const QPAttr &b) {
+    return a.qpn == b.qpn && a.lid == b.lid && memcmp(&a.addr,&b.addr,sizeof(a.addr)) == 0;
+  }
+
+  ConnStatus reset_and_connect(QPAttr &remote_attr) {
+    if(!RCQPImpl::reset(qp_)) {
+      RDMA_LOG(WARNING) << "reset qp error: " << strerror(errno);
+      return ERR;
+    }
+    RCQPImpl::ready2init<F>(qp_,rnic_);
+    return connect(remote_attr);
+  }
+
+  // the wr_id of the empty write posted by quiesce
+  static const uint64_t QUIESCE_WR_ID = 0x4e51000000000000ULL;
+
+  /**
+   * Wait until all requests posted to the QP complete. Unsignaled requests are not completed one by one,
+   * so a signaled empty write is posted, whose completion means the ones before it have completed.
+   * The user's completions polled meanwhile are stashed.
+   */
+  ConnStatus quiesce(struct timeval timeout = default_timeout) {
+
+    if(recovery_->outstanding() == 0)
+      return SUCC;
+
+    struct ibv_send_wr sr = {};
+    sr.wr_id      = QUIESCE_WR_ID;
+    sr.opcode     = IBV_WR_RDMA_WRITE;
+    sr.num_sge    = 0;
+    sr.send_flags = IBV_SEND_SIGNALED;
+    sr.wr.rdma.remote_addr = remote_mr_.buf;
+    sr.wr.rdma.rkey        = remote_mr_.key;
+    auto ret = post_recorded(&sr);
+    if(ret != SUCC)
+      return ret;
+
+    struct timeval start_time; gettimeofday(&start_time,nullptr);
+    while(recovery_->outstanding() > 0) {
+      if(recovery_->failed())
+        return ERR;  // recovered by the next post or poll, according to the policy
+      if(reap_completion() < 0)
+        return ERR;
+      struct timeval cur_time; gettimeofday(&cur_time,nullptr);
+      if(diff_time(cur_time,start_time) > timeout.tv_sec * 1000 + timeout.tv_usec)
+        return TIMEOUT;
+    }
+    return SUCC;
+  }
+
+  /**
+   * Post the request(s) and record them for recovery.
+   * The QP is recovered first if it has failed, and the post is retried once if the QP fails meanwhile.
+   */
+  ConnStatus post_recorded(struct ibv_send_wr *sr,struct ibv_send_wr **bad_sr_addr = nullptr) {
+
+    struct ibv_send_wr *bad_sr;
+    for(int retry = 0;retry < 2;++retry) {
+
+      if(need_recovery() && recover() != SUCC)
+        return ERR;
+
+      // record the requests, whose wr_ids are restored after posting
+      int num = 0;
+      for(auto cur = sr;cur != nullptr;cur = cur->next,++num) {
+        if(!recovery_->record(cur)) {
+          RDMA_LOG(WARNING) << "too many outstanding requests to record";
+          for(auto r = sr;r != cur;r = r->next)
+            r->wr_id = recovery_->user_wr_id(r->wr_id);
+          recovery_->cancel(num);
+          return ERR;
+        }
+      }
+
+      auto rc = ibv_post_send(qp_,sr,&bad_sr);
+
+      int posted = 0;
+      for(auto cur = sr;cur != nullptr;cur = cur->next) {
+        if(rc != 0 && cur == bad_sr)
+          break;
+        posted += 1;
+      }
+      for(auto cur = sr;cur != nullptr;cur = cur->next)
+        cur->wr_id = recovery_->user_wr_id(cur->wr_id);
+      recovery_->cancel(num - posted);
+
+      if(rc == 0)
+        return SUCC;
+      if(bad_sr_addr != nullptr)
+        *bad_sr_addr = bad_sr;
+      if(posted > 0 || !(need_recovery() || check_async_events()))
+        return ERR;
+    }
+    return ERR;
+  }
+
+  /**
+   * return true if the completion is generated by write combining or staging,
+   * which shall not be passed to the user
+   */
+  inline bool internal_completion(ibv_wc &wc) {
+    if(recovery_ != nullptr && (recovery_->on_completion(wc) || wc.wr_id == QUIESCE_WR_ID))
+      return true;
+    if(combiner_ != nullptr && combiner_->on_completion(wc))
+      return true;
+    if(stager_ != nullptr && stager_->on_completion(wc))
+      return true;
+    return false;
+  }
+
+  /**
+   * Poll one completion for internal usage, the user's ones are stashed
+   */
+  int reap_completion() {
+    ibv_wc wc;
+    auto n = ibv_poll_cq(cq_,1,&wc);
+    if(n < 0) {
+      RDMA_LOG(ERROR) << "poll cq error: " << strerror(errno);
+      return n;
+    }
+    if(n > 0 && !internal_completion(wc))
+      stashed_wcs_.push_back(wc);
+    return n;
+  }
+
+  /**
+   * return true if the request is merged into the pending writes, or flushing them fails;
+   * ret is set to the result of the request.
+   */
+  bool combine_write(MemoryAttr &remote_mr,ibv_wr_opcode op,char *local_buf,uint32_t len,uint64_t off,int flags,
+                     ConnStatus &ret) {
+
+    ret = SUCC;
+    if(op == IBV_WR_RDMA_WRITE && !(flags & IBV_SEND_SIGNALED) && len <= combiner_->window_size()) {
+      if(combiner_->expired() && (ret = flush_writes()) != SUCC)
+        return true;
+      if(combiner_->merge(remote_mr,local_buf,len,off))
+        return true;
+      if((ret = flush_writes()) != SUCC)
+        return true;
+      return combiner_->merge(remote_mr,local_buf,len,off);
+    }
+
+    // reads which do not touch the pending writes need not to wait for them
+    if(op != IBV_WR_RDMA_READ || combiner_->overlap(remote_mr,off,len))
+      return (ret = flush_writes()) != SUCC;
+    return false;
+  }
+};
+
+inline constexpr UCConfig default_uc_config() {
+  return UCConfig {
+    .access_flags       = IBV_ACCESS_REMOTE_WRITE, // UC does not support RDMA read & atomics
+    .rq_psn             = DEFAULT_PSN,
+    .sq_psn             = DEFAULT_PSN,
+    .sl                 = 0,
+    .traffic_class      = 0
+  };
+}
+
+/**
+ * Raw UC QP
+ * It shares the same connect/bind/post interfaces with RRCQP, yet only RDMA write & send are supported.
+ * Note that UC has no retransmission, so a lost packet silently drops the whole message.
+ */
+template <UCConfig (*F)(void) = default_uc_config>
+class RUCQP : public QP {
+ public:
+  RUCQP(RNicHandler *rnic,QPIdx idx,
+        MemoryAttr local_mr,MemoryAttr remote_mr)
+      :RUCQP(rnic,idx) {
+    bind_local_mr(local_mr);
+    bind_remote_mr(remote_mr);
+  }
+
+  RUCQP(RNicHandler *rnic,QPIdx idx,MemoryAttr local_mr)
+      :RUCQP(rnic,idx) {
+    bind_local_mr(local_mr);
+  }
+
+  RUCQP(RNicHandler *rnic,QPIdx idx)
+      :QP(rnic,idx)
+  {
+    UCQPImpl::init<F>(qp_,cq_,rnic_);
+  }
+
+  ConnStatus connect(std::string ip,int port) {
+    return connect(ip,port,idx_);
+  }
+
+  ConnStatus connect(std::string ip,int port,QPIdx idx) {
+
+    // first check whether QP is valid to connect
+    enum ibv_qp_state state;
+    if( (state = QPImpl::query_qp_status(qp_)) != IBV_QPS_INIT) {
+      if(state != IBV_QPS_RTS)
+        RDMA_LOG(WARNING) << "qp not in a correct state to connect!";
+      return (state == IBV_QPS_RTS)?SUCC:UNKNOWN;
+    }
+    ConnArg arg = {} ; ConnReply reply = {};
+    arg.type = ConnArg::QP;
+    arg.payload.qp.from_node   = idx.node_id;
+    arg.payload.qp.from_worker = idx.worker_id;
+    arg.payload.qp.from_index  = idx.index;
+    arg.payload.qp.qp_type     = IBV_QPT_UC;
+
+    auto ret = QPImpl::get_remote_helper(&arg,&reply,ip,port);
+    if(ret == SUCC) {
+      // change QP status
+      auto flow_label = compute_flow_label(qp_->qp_num,reply.payload.qp.qpn);
+      if(!UCQPImpl::ready2rcv<F>(qp_,reply.payload.qp,rnic_,flow_label)) {
+        RDMA_LOG(WARNING) << "change qp status to ready to receive error: " << strerror(errno);
+        return ERR;
+      }
+
+      if(!UCQPImpl::ready2send<F>(qp_)) {
+        RDMA_LOG(WARNING) << "change qp status to ready to send error: " << strerror(errno);
+        return ERR;
+      }
+    }
+    return ret;
+  }
+
+  void bind_remote_mr(MemoryAttr attr) {
+    remote_mr_ = attr;
+  }
+
+  ConnStatus post_send_to_mr(MemoryAttr &local_mr,MemoryAttr &remote_mr,
+                             ibv_wr_opcode op,char *local_buf,uint32_t len,uint64_t off,int flags,
+                             uint64_t wr_id = 0, uint32_t imm = 0) {
+    switch(op) {
+      case IBV_WR_RDMA_WRITE:
+      case IBV_WR_RDMA_WRITE_WITH_IMM:
+      case IBV_WR_SEND:
+      case IBV_WR_SEND_WITH_IMM:
+        break;
+      default:
+        return WRONG_ARG; // UC cannot read or do atomics
+    }
+
+    struct ibv_send_wr *bad_sr;
+
+    struct ibv_sge sge {
+      .addr = (uint64_t)local_buf,
+          .length = len,
+          .lkey   = local_mr.key
+          };
+
+    struct ibv_send_wr sr;
+    sr.wr_id        = wr_id;
+    sr.opcode       = op;
+    sr.num_sge      = 1;
+    sr.next         = NULL;
+    sr.sg_list      = &sge;
+    sr.send_flags   = flags;
+    sr.imm_data     = imm;
+
+    sr.wr.rdma.remote_addr = remote_mr.buf + off;
+    sr.wr.rdma.rkey        = remote_mr.key;
+
+    auto rc = ibv_post_send(qp_,&sr,&bad_sr);
+    return rc == 0 ? SUCC : ERR;
+  }
+
+  ConnStatus post_send(ibv_wr_opcode op,char *local_buf,uint32_t len,uint64_t off,int flags,
+                       uint64_t wr_id = 0, uint32_t imm = 0) {
+    return post_send_to_mr(local_mr_,remote_mr_,op,local_buf,len,off,flags,wr_id,imm);
+  }
+
+  ConnStatus post_batch(struct ibv_send_wr *send_sr,ibv_send_wr **bad_sr_addr,int num = 0) {
+    auto rc = ibv_post_send(qp_,send_sr,bad_sr_addr);
+    return rc == 0 ? SUCC : ERR;
+  }
+
+  int poll_send_completion(ibv_wc &wc) {
+    return ibv_poll_cq(cq_,1,&wc);
+  }
+
+  ConnStatus poll_till_completion(ibv_wc &wc,struct timeval timeout = default_timeout) {
+    auto ret = QP::poll_till_completion(wc,timeout);
+    if(ret == SUCC) {
+      low_watermark_ = high_watermark_;
+    }
+    return ret;
+  }
+
+  bool need_poll(int threshold = (UCQPImpl::UC_MAX_SEND_SIZE / 2)) {
+    return (high_watermark_ - low_watermark_) >= (uint64_t)threshold;
   }
 
   uint64_t high_watermark_ = 0;
@@ -325,12 +1136,15 @@ inline constexpr UDConfig default_ud_config() {
     .max_send_size  = UDQPImpl::MAX_SEND_SIZE,
     .max_recv_size  = UDQPImpl::MAX_RECV_SIZE,
     .qkey           = DEFAULT_QKEY,
-    .psn            = DEFAULT_PSN
+    .psn            = DEFAULT_PSN,
+    .sl             = 0,
+    .traffic_class  = 0
  };
 }
 
 /**
  * Raw UD QP
+ * MAX_SERVER_NUM is no longer a limit, since the peers are kept by the device (UDPeerTable).
  */
 template <UDConfig (*F)(void) = default_ud_config, int MAX_SERVER_NUM = 16>
 class RUDQP : public QP {
@@ -343,9 +1157,9 @@ class RUDQP : public QP {
   }
 
   RUDQP(RNicHandler *rnic,QPIdx idx)
-      :QP(rnic,idx) {
+      :QP(rnic,idx),
+       peers_(&rnic->ud_peers) {
     UDQPImpl::init<F>(qp_,cq_,recv_cq_,rnic_);
-    std::fill_n(ahs_,MAX_SERVER_NUM,nullptr);
   }
 
   bool queue_empty() {
@@ -375,8 +1189,23 @@ class RUDQP : public QP {
   }
 
   ConnStatus connect(std::string ip,int port,QPIdx idx) {
+    return connect(ip,port,idx,nullptr);
+  }
+
+  /**
+   * If node_id is given, it is set to the remote's node id once connected.
+   * The remote QP is the one of idx at the node; a UD QP sends to the QPs of the same idx at all nodes.
+   */
+  ConnStatus connect(std::string ip,int port,QPIdx idx,int *node_id) {
 
-    ConnArg arg; ConnReply reply;
+    int slot = peers_->slot(idx.worker_id,idx.index);
+    if(slot < 0) {
+      RDMA_LOG(WARNING) << "too many remote UD QPs at device, max " << UDPeerTable::MAX_SLOTS;
+      return ERR;
+    }
+    RDMA_ASSERT(slot_ < 0 || slot_ == slot) << "a UD QP shall connect to the QPs of the same idx";
+
+    ConnArg arg = {}; ConnReply reply = {};
     arg.type = ConnArg::QP;
     arg.payload.qp.from_node   = idx.worker_id;
     arg.payload.qp.from_worker = idx.index;
@@ -385,20 +1214,44 @@ class RUDQP : public QP {
     auto ret = QPImpl::get_remote_helper(&arg,&reply,ip,port);
 
     if(ret == SUCC) {
-      // create the ah, and store the address handler
-      auto ah = UDQPImpl::create_ah(rnic_,reply.payload.qp);
+      // get the (shared) ah, and store it with the remote QPN in the device's table
+      auto ah_attr = UDQPImpl::make_ah_attr(rnic_,reply.payload.qp,F().sl,F().traffic_class,
+                                            peer_flow_label(reply.payload.qp));
+      auto ah = rnic_->ah_cache.get(rnic_->pd,ah_attr);
       if(ah == nullptr) {
         RDMA_LOG(WARNING) << "create address handler error: " << strerror(errno);
         ret = ERR;
       } else {
-        ahs_[reply.payload.qp.node_id]   = ah;
-        attrs_[reply.payload.qp.node_id] = reply.payload.qp;
+        peers_->set(reply.payload.qp.node_id,slot,reply.payload.qp.qpn,ah,ah_attr);
+        slot_ = slot;
+        if(node_id != nullptr)
+          *node_id = reply.payload.qp.node_id;
       }
     }
  CONN_END:
     return ret;
   }
 
+  /**
+   * Use a different service level & traffic class (than the UDConfig) to the connected node,
+   * by replacing its address handler. The AH is shared, so it applies to all UD QPs of the device.
+   */
+  ConnStatus set_traffic_class(int node_id,int sl,int traffic_class) {
+    auto e = peers_->get(node_id);
+    if(e == nullptr)
+      return NOT_READY;
+    ibv_ah_attr ah_attr = e->ah_attr;
+    ah_attr.sl = sl;
+    ah_attr.grh.traffic_class = traffic_class;
+    auto ah = rnic_->ah_cache.get(rnic_->pd,ah_attr);
+    if(ah == nullptr) {
+      RDMA_LOG(WARNING) << "create address handler error: " << strerror(errno);
+      return ERR;
+    }
+    peers_->set(node_id,slot_,e->qpns[slot_],ah,ah_attr);
+    return SUCC;
+  }
+
   /**
    * whether this UD QP has been post recved
    * a UD QP should be first been post_recved; then it can be connected w others
@@ -414,12 +1267,29 @@ class RUDQP : public QP {
   friend class UDAdapter;
  private:
   /**
-   * FIXME: curretly we have limited servers, so we use an array.
-   * using a map will affect the perfomrance in microbenchmarks.
-   * remove it, and merge this in UDAdapter?
+   * The AHs & remote QPNs are kept by the device (indexed by the node id), and the QPN of a node's QP
+   * is at slot_ of its entry; so a send costs two lookups at any cluster size.
+   * The AHs are owned by the device's AHCache.
+   */
+  UDPeerTable *peers_;
+  int slot_ = -1;
+
+  // the AH & QPN of the connected node
+  inline ibv_ah *ah(int node_id) const {
+    return peers_->get(node_id)->ah.load(std::memory_order_relaxed);
+  }
+
+  inline uint32_t remote_qpn(int node_id) const {
+    return peers_->get(node_id)->qpns[slot_];
+  }
+
+  /**
+   * AHs are shared by all UD QPs to the peer, so the flow label depends on the peer only;
+   * UD traffic is spread over the paths by the peers.
    */
-  struct ibv_ah *ahs_[MAX_SERVER_NUM];
-  struct QPAttr  attrs_[MAX_SERVER_NUM];
+  static inline uint32_t peer_flow_label(const QPAttr &attr) {
+    return compute_flow_label((uint32_t)(attr.addr.interface_id ^ (attr.addr.interface_id >> 32)),attr.lid);
+  }
 
   // current outstanding requests which have not been polled
   int pendings = 0;
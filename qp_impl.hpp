@@ -24,6 +24,21 @@ enum  {
   UD_ID_BASE = 20000
 };
 
+/**
+ * The flow label of the packets sent by a QP (20 bits).
+ * RoCEv2 RNICs derive the UDP source port from it, which the switches hash for ECMP,
+ * so QPs between the same pair of hosts shall use distinct labels to spread over the paths.
+ * A different salt moves the QP to (likely) another path.
+ */
+inline uint32_t compute_flow_label(uint32_t local_qpn,uint32_t remote_qpn,uint32_t salt = 0) {
+  uint64_t h = ((uint64_t)local_qpn << 32 | remote_qpn) ^ ((uint64_t)salt * 0x9e3779b97f4a7c15ULL);
+  h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  uint32_t label = h & 0xfffff;
+  return label == 0 ? 1 : label; // 0 means no flow label
+}
+
 inline constexpr uint32_t index_mask() {
   return 0xffff;
 }
@@ -106,6 +121,23 @@ class QPImpl {
     return ret;
   }
 
+  /**
+   * Query whether the worker at the remote has joined the multicast group.
+   * return SUCC if it has, and node_id is set to the remote's node id; NOT_READY if not.
+   */
+  static ConnStatus get_group_member(std::string ip,int port,uint32_t group_id,int worker_id,int *node_id) {
+
+    ConnArg arg; ConnReply reply;
+    arg.type = ConnArg::GROUP;
+    arg.payload.group.group_id  = group_id;
+    arg.payload.group.worker_id = worker_id;
+
+    auto ret = get_remote_helper(&arg,&reply,ip,port);
+    if(ret == SUCC)
+      *node_id = reply.payload.node_id;
+    return ret;
+  }
+
   static ConnStatus poll_till_completion(ibv_cq *cq,ibv_wc &wc, struct timeval timeout) {
 
     struct timeval start_time; gettimeofday (&start_time, nullptr);
@@ -164,7 +196,7 @@ class RCQPImpl {
   }
 
   template <RCConfig (*F)(void)>
-  static bool ready2rcv(ibv_qp *qp,QPAttr &attr,RNicHandler *rnic) {
+  static bool ready2rcv(ibv_qp *qp,QPAttr &attr,RNicHandler *rnic,uint32_t flow_label = 0) {
 
     auto config = F();
 
@@ -178,7 +210,7 @@ class RCQPImpl {
     qp_attr.min_rnr_timer         = 20;
 
     qp_attr.ah_attr.dlid          = attr.lid;
-    qp_attr.ah_attr.sl            = 0;
+    qp_attr.ah_attr.sl            = config.sl;
     qp_attr.ah_attr.src_path_bits = 0;
     qp_attr.ah_attr.port_num      = rnic->port_id; /* Local port! */
 
@@ -186,8 +218,9 @@ class RCQPImpl {
     qp_attr.ah_attr.grh.dgid.global.subnet_prefix = attr.addr.subnet_prefix;
     qp_attr.ah_attr.grh.dgid.global.interface_id  = attr.addr.interface_id;
     qp_attr.ah_attr.grh.sgid_index                = 0;
-    qp_attr.ah_attr.grh.flow_label                = 0;
+    qp_attr.ah_attr.grh.flow_label                = flow_label;
     qp_attr.ah_attr.grh.hop_limit                 = 255;
+    qp_attr.ah_attr.grh.traffic_class             = config.traffic_class;
 
     int flags = IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN | IBV_QP_RQ_PSN
                 | IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER;
@@ -218,8 +251,24 @@ class RCQPImpl {
     return rc == 0;
   }
 
+  /**
+   * Move the QP back to RESET, where the outstanding requests are discarded.
+   * Afterwards it shall be changed to INIT (ready2init) before connecting again.
+   */
+  static bool reset(ibv_qp *qp) {
+    struct ibv_qp_attr qp_attr = {};
+    qp_attr.qp_state = IBV_QPS_RESET;
+    auto rc = ibv_modify_qp(qp, &qp_attr,IBV_QP_STATE);
+    return rc == 0;
+  }
+
+  /**
+   * If a shared receive queue (srq) is given, the QP takes receives from it and reports
+   * them to recv_cq, so it allocates no receive WQEs of its own.
+   */
   template <RCConfig (*F)(void)>
-  static void init(ibv_qp *&qp,ibv_cq *&cq,RNicHandler *rnic) {
+  static void init(ibv_qp *&qp,ibv_cq *&cq,RNicHandler *rnic,
+                   ibv_cq *recv_cq = nullptr,ibv_srq *srq = nullptr) {
 
     // create the CQ
     cq = ibv_create_cq(rnic->ctx, RC_MAX_SEND_SIZE, nullptr, nullptr, 0);
@@ -229,11 +278,125 @@ class RCQPImpl {
     struct ibv_qp_init_attr qp_init_attr = {};
 
     qp_init_attr.send_cq = cq;
-    qp_init_attr.recv_cq = cq; // TODO, need seperate handling for two-sided over RC QP
+    qp_init_attr.recv_cq = (recv_cq != nullptr) ? recv_cq : cq;
+    qp_init_attr.srq     = srq;
     qp_init_attr.qp_type = IBV_QPT_RC;
 
     qp_init_attr.cap.max_send_wr = RC_MAX_SEND_SIZE;
-    qp_init_attr.cap.max_recv_wr = RC_MAX_RECV_SIZE;	/* Can be set to 1, if RC Two-sided is not required */
+    qp_init_attr.cap.max_recv_wr = (srq != nullptr) ? 0 : RC_MAX_RECV_SIZE; /* Can be set to 1, if RC Two-sided is not required */
+    qp_init_attr.cap.max_send_sge = 1;
+    qp_init_attr.cap.max_recv_sge = 1;
+    qp_init_attr.cap.max_inline_data = MAX_INLINE_SIZE;
+
+    qp = ibv_create_qp(rnic->pd, &qp_init_attr);
+    RDMA_VERIFY(WARNING,qp != nullptr);
+
+    if(qp)
+      ready2init<F>(qp,rnic);
+  }
+
+  /**
+   * Create a shared receive queue, which can be shared by RC QPs created on the same rnic.
+   */
+  static ibv_srq *create_srq(RNicHandler *rnic,int max_wr) {
+    struct ibv_srq_init_attr srq_init_attr = {};
+    srq_init_attr.attr.max_wr  = max_wr;
+    srq_init_attr.attr.max_sge = 1;
+
+    auto srq = ibv_create_srq(rnic->pd, &srq_init_attr);
+    RDMA_VERIFY(WARNING,srq != nullptr) << "create srq error: " << strerror(errno);
+    return srq;
+  }
+};
+
+/**
+ * UC QP shares the connection procedure with RC, but it has no ACK, no retransmission
+ * and no RDMA read/atomic. So fewer attributes are needed to change its status.
+ */
+class UCQPImpl {
+ public:
+  UCQPImpl()  = default;
+  ~UCQPImpl() = default;
+
+  static const int UC_MAX_SEND_SIZE = 128;
+  static const int UC_MAX_RECV_SIZE = 128;
+
+  template <UCConfig (*F)(void)>
+  static void ready2init(ibv_qp *qp,RNicHandler *rnic) {
+
+    auto config = F();
+
+    struct ibv_qp_attr qp_attr = {};
+    qp_attr.qp_state           = IBV_QPS_INIT;
+    qp_attr.pkey_index         = 0;
+    qp_attr.port_num           = rnic->port_id;
+    qp_attr.qp_access_flags    = config.access_flags;
+
+    int flags = IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS;
+    int rc = ibv_modify_qp(qp, &qp_attr,flags);
+    RDMA_VERIFY(WARNING,rc == 0) <<  "Failed to modify UC to INIT state, %s\n" <<  strerror(errno);
+  }
+
+  template <UCConfig (*F)(void)>
+  static bool ready2rcv(ibv_qp *qp,QPAttr &attr,RNicHandler *rnic,uint32_t flow_label = 0) {
+
+    auto config = F();
+
+    struct ibv_qp_attr qp_attr = {};
+
+    qp_attr.qp_state              = IBV_QPS_RTR;
+    qp_attr.path_mtu              = IBV_MTU_4096;
+    qp_attr.dest_qp_num           = attr.qpn;
+    qp_attr.rq_psn                = config.rq_psn;
+
+    qp_attr.ah_attr.dlid          = attr.lid;
+    qp_attr.ah_attr.sl            = config.sl;
+    qp_attr.ah_attr.src_path_bits = 0;
+    qp_attr.ah_attr.port_num      = rnic->port_id; /* Local port! */
+
+    qp_attr.ah_attr.is_global                     = 1;
+    qp_attr.ah_attr.grh.dgid.global.subnet_prefix = attr.addr.subnet_prefix;
+    qp_attr.ah_attr.grh.dgid.global.interface_id  = attr.addr.interface_id;
+    qp_attr.ah_attr.grh.sgid_index                = 0;
+    qp_attr.ah_attr.grh.flow_label                = flow_label;
+    qp_attr.ah_attr.grh.hop_limit                 = 255;
+    qp_attr.ah_attr.grh.traffic_class             = config.traffic_class;
+
+    int flags = IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN | IBV_QP_RQ_PSN;
+    auto rc = ibv_modify_qp(qp, &qp_attr,flags);
+    return rc == 0;
+  }
+
+  template <UCConfig (*F)(void)>
+  static bool ready2send(ibv_qp *qp) {
+
+    auto config = F();
+
+    struct ibv_qp_attr qp_attr = {};
+    qp_attr.qp_state           = IBV_QPS_RTS;
+    qp_attr.sq_psn             = config.sq_psn;
+
+    int flags = IBV_QP_STATE | IBV_QP_SQ_PSN;
+    auto rc = ibv_modify_qp(qp, &qp_attr,flags);
+    return rc == 0;
+  }
+
+  template <UCConfig (*F)(void)>
+  static void init(ibv_qp *&qp,ibv_cq *&cq,RNicHandler *rnic) {
+
+    // create the CQ
+    cq = ibv_create_cq(rnic->ctx, UC_MAX_SEND_SIZE, nullptr, nullptr, 0);
+    RDMA_VERIFY(WARNING,cq != nullptr) << "create cq error: " << strerror(errno);
+
+    // create the QP
+    struct ibv_qp_init_attr qp_init_attr = {};
+
+    qp_init_attr.send_cq = cq;
+    qp_init_attr.recv_cq = cq;
+    qp_init_attr.qp_type = IBV_QPT_UC;
+
+    qp_init_attr.cap.max_send_wr = UC_MAX_SEND_SIZE;
+    qp_init_attr.cap.max_recv_wr = UC_MAX_RECV_SIZE; /* only used by send/write with imm */
     qp_init_attr.cap.max_send_sge = 1;
     qp_init_attr.cap.max_recv_sge = 1;
     qp_init_attr.cap.max_inline_data = MAX_INLINE_SIZE;
@@ -282,7 +445,7 @@ class UDQPImpl {
 
 	qp_init_attr.cap.max_send_wr  = config.max_send_size;
 	qp_init_attr.cap.max_recv_wr  = config.max_recv_size;
-	qp_init_attr.cap.max_send_sge = 1;
+	qp_init_attr.cap.max_send_sge = 2; // a fragment gathers its header & payload
 	qp_init_attr.cap.max_recv_sge = 1;
 	qp_init_attr.cap.max_inline_data = MAX_INLINE_SIZE;
 
@@ -343,22 +506,34 @@ class UDQPImpl {
     return rc == 0;
   }
 
-  static ibv_ah *create_ah(RNicHandler *rnic,QPAttr &attr) {
+  /**
+   * Get the address handler to the remote UD QP, using the given service level, traffic class & flow label.
+   * AHs are cached per device by the remote address, sl & traffic class, see AHCache.
+   */
+  static ibv_ah *create_ah(RNicHandler *rnic,QPAttr &attr,int sl = 0,int traffic_class = 0,
+                           uint32_t flow_label = 0) {
+    auto ah_attr = make_ah_attr(rnic,attr,sl,traffic_class,flow_label);
+    // the AH is shared with the other UD QPs of the device, so it shall not be destroyed
+    return rnic->ah_cache.get(rnic->pd,ah_attr);
+  }
+
+  static ibv_ah_attr make_ah_attr(RNicHandler *rnic,QPAttr &attr,int sl = 0,int traffic_class = 0,
+                                  uint32_t flow_label = 0) {
 
-    struct ibv_ah_attr ah_attr;
+    struct ibv_ah_attr ah_attr = {};
     ah_attr.is_global = 1;
     ah_attr.dlid = attr.lid;
-    ah_attr.sl = 0;
+    ah_attr.sl = sl;
     ah_attr.src_path_bits = 0;
     ah_attr.port_num = attr.port_id;
 
     ah_attr.grh.dgid.global.subnet_prefix = attr.addr.subnet_prefix;
     ah_attr.grh.dgid.global.interface_id = attr.addr.interface_id;
-    ah_attr.grh.flow_label = 0;
+    ah_attr.grh.flow_label = flow_label;
     ah_attr.grh.hop_limit = 255;
     ah_attr.grh.sgid_index = rnic->gid;
-
-    return ibv_create_ah(rnic->pd, &ah_attr);
+    ah_attr.grh.traffic_class = traffic_class;
+    return ah_attr;
   }
 
 };
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <vector>
+
+#include "msg_interface.hpp"
+#include "rdma_ctrl.hpp"
+#include "ralloc/ralloc.h"
+
+/**
+ * The Adapter use RC QPs' two-sided send/recv.
+ * All RC QPs of one worker share one receive queue (SRQ) & one receive CQ.
+ */
+namespace rdmaio {
+
+class RCRecvManager {
+ public:
+  RCRecvManager(RNicHandler *rnic,int max_recv_num,int max_msg_size,MemoryAttr local_mr):
+      max_recv_num_(max_recv_num),
+      max_msg_size_(max_msg_size)
+  {
+    RDMA_ASSERT(max_recv_num_ <= MAX_RECV_SIZE)
+        << "RC SRQ can register at most " << MAX_RECV_SIZE << "buffers.";
+    RDMA_ASSERT(max_idle_recv_num_ < max_recv_num_);
+
+    recv_cq_ = ibv_create_cq(rnic->ctx, max_recv_num_, nullptr, nullptr, 0);
+    RDMA_ASSERT(recv_cq_ != nullptr) << "create recv cq for RC SRQ error: " << strerror(errno);
+
+    srq_ = RCQPImpl::create_srq(rnic,max_recv_num_);
+    RDMA_ASSERT(srq_ != nullptr);
+
+    // allocate local heap
+    RThreadLocalInit();
+
+    // init receive related structures
+    for(int i = 0;i < max_recv_num_;++i) {
+      struct ibv_sge sge {
+        .addr   = (uintptr_t)(Rmalloc(max_msg_size_)),
+        .length = (uint32_t)max_msg_size_,
+        .lkey   = local_mr.key
+      };
+      RDMA_ASSERT(sge.addr != 0) << "failed to allocate recv buffer.";
+      sges_[i] = sge;
+
+      rrs_[i].wr_id  = sges_[i].addr;
+      rrs_[i].sg_list = &sges_[i];
+      rrs_[i].num_sge = 1;
+
+      rrs_[i].next    = (i < (max_recv_num_ - 1)) ? &rrs_[i + 1] : &rrs_[0];
+    }
+
+    post_recvs(max_recv_num_);
+  }
+
+ public:
+  // max number of receive buffers of a worker
+  static const int MAX_RECV_SIZE = 4096;
+  // max number of completions handled in one poll
+  static const int MAX_POLL_SIZE = 64;
+
+ protected:
+  ibv_cq  *recv_cq_ = nullptr;
+  ibv_srq *srq_     = nullptr;
+
+  int recv_head_ = 0;
+  int idle_recv_num_ = 0;
+  int max_idle_recv_num_ = 32; // re-post receives in batches of this size
+  int max_recv_num_ = 0;
+  int max_msg_size_ = 0;
+
+  struct ibv_recv_wr rrs_[MAX_RECV_SIZE];
+  struct ibv_sge sges_[MAX_RECV_SIZE];
+  struct ibv_wc wcs_[MAX_POLL_SIZE];
+  struct ibv_recv_wr *bad_rr_;
+
+  void post_recvs(int recv_num) {
+
+    if(recv_num <= 0) {
+      return;
+    }
+
+    int tail = recv_head_ + recv_num - 1;
+    if(tail >= max_recv_num_)
+      tail -= max_recv_num_;
+
+    ibv_recv_wr  *head_rr = rrs_ + recv_head_;
+    ibv_recv_wr  *tail_rr = rrs_ + tail;
+    ibv_recv_wr  *temp = tail_rr->next;
+    tail_rr->next = NULL;
+
+    int rc = ibv_post_srq_recv(srq_,head_rr,&bad_rr_);
+    if(rc != 0) {
+      RDMA_LOG(ERROR) << "post srq recv " << recv_num << "; w error: " << strerror(errno) ;
+    }
+    tail_rr->next = temp;
+    recv_head_ = (tail + 1) % max_recv_num_;
+  }
+};
+
+/**
+ * Messages larger than the MTU are segmented by the RNIC, so a message can be as large
+ * as the receive buffer (max_msg_size).
+ * Note that both sides shall use the same max_msg_size.
+ */
+class RCAdapter : public MsgAdapter, public RCRecvManager {
+ public:
+  static const int DEFAULT_MAX_MSG_SIZE = 16 * 1024;
+  // the QP index reserved for RCAdapter's QPs, so they are not mixed with the ones used for one-sided ops
+  static const int QP_IDX = 63;
+
+  RCAdapter(std::shared_ptr<RdmaCtrl> cm, RNicHandler *rnic, MemoryAttr local_mr,
+            int w_id, int max_recv_num,int max_msg_size = DEFAULT_MAX_MSG_SIZE):
+      RCRecvManager(rnic,max_recv_num,max_msg_size,local_mr),
+      cm_(cm),
+      rnic_(rnic),
+      local_mr_(local_mr),
+      node_id_(cm->current_node_id()),
+      worker_id_(w_id)
+  {
+  }
+
+  /**
+   * Connect to the RCAdapter of the same worker id at the remote.
+   * The local QP is created once the remote's node id is known, so the remote can connect back to it.
+   * return NOT_READY if the remote RCAdapter has not created its QP yet; the caller shall retry.
+   */
+  ConnStatus connect(std::string ip,int port) {
+
+    ConnArg arg = {}; ConnReply reply = {};
+    arg.type = ConnArg::QP;
+    arg.payload.qp.from_node   = node_id_;
+    arg.payload.qp.from_worker = worker_id_;
+    arg.payload.qp.from_index  = QP_IDX;
+    arg.payload.qp.qp_type     = IBV_QPT_RC;
+
+    auto ret = QPImpl::get_remote_helper(&arg,&reply,ip,port);
+    if(ret != SUCC && ret != NOT_READY)
+      return ret;
+
+    // the remote always replies its node id, even it has not created the QP
+    RCQP *qp = create_qp(reply.payload.qp.node_id);
+    if(qp == nullptr)
+      return ERR;
+    if(ret == SUCC)
+      ret = qp->connect(reply.payload.qp);
+    return ret;
+  }
+
+  ConnStatus send_to(int node_id,const char *msg,int len) {
+
+    if(len > max_msg_size_)
+      return WRONG_ARG;
+
+    RCQP *qp = get_qp(node_id);
+    if(qp == nullptr)
+      return NOT_READY;
+
+    if(qp->need_poll()) {
+      ibv_wc wc; auto ret = qp->poll_till_completion(wc);
+      RDMA_ASSERT(ret == SUCC) << "poll RC completion reply error: " << ret;
+    }
+    int flags = ((qp->high_watermark_ == qp->low_watermark_) ? IBV_SEND_SIGNALED : 0)
+                | ((len < MAX_INLINE_SIZE) ? IBV_SEND_INLINE : 0);
+    qp->high_watermark_ += 1;
+
+    return qp->post_send(IBV_WR_SEND_WITH_IMM,(char *)msg,len,0,flags,0,
+                         ::rdmaio::encode_qp_id(node_id_,worker_id_));
+  }
+
+  /**
+   * Each RC QP has its own doorbell, so there is no benefit to batch requests of different nodes.
+   */
+  ConnStatus send_pending(int node_id,const char *msg,int len) {
+    return send_to(node_id,msg,len);
+  }
+
+  void poll_comps() {
+
+    int poll_result = ibv_poll_cq(recv_cq_,MAX_POLL_SIZE,wcs_);
+    for(int i = 0;i < poll_result;++i) {
+      RDMA_ASSERT(wcs_[i].status == IBV_WC_SUCCESS)
+          << "error wc status " << wcs_[i].status << " at " << worker_id_;
+      callback_((const char *)(wcs_[i].wr_id),::rdmaio::decode_qp_mac(wcs_[i].imm_data),
+                ::rdmaio::decode_qp_index(wcs_[i].imm_data));
+    }
+    idle_recv_num_ += poll_result;
+    if(idle_recv_num_ >= max_idle_recv_num_) {
+      post_recvs(idle_recv_num_);
+      idle_recv_num_ = 0;
+    }
+  }
+
+ private:
+  std::shared_ptr<RdmaCtrl> cm_;
+  RNicHandler *rnic_;
+  MemoryAttr   local_mr_;
+
+  const int node_id_;   // my node id
+  const int worker_id_; // my thread id
+
+  // QPs to other nodes, indexed by the node id
+  std::vector<RCQP *> qps_;
+
+  inline RCQP *get_qp(int node_id) {
+    return ((size_t)node_id < qps_.size()) ? qps_[node_id] : nullptr;
+  }
+
+  RCQP *create_qp(int node_id) {
+    if((size_t)node_id >= qps_.size())
+      qps_.resize(node_id + 1,nullptr);
+    if(qps_[node_id] == nullptr)
+      qps_[node_id] = cm_->create_rc_qp(QPIdx {.node_id = node_id,.worker_id = worker_id_,.index = QP_IDX },
+                                        rnic_,&local_mr_,recv_cq_,srq_);
+    return qps_[node_id];
+  }
+};
+
+} // namespace rdmaio
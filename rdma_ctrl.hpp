@@ -1,14 +1,18 @@
 #pragma once
 
 #include <memory>
+#include <functional>
 
 #include "qp.hpp"
+#include "shared_qp.hpp"
 
 namespace rdmaio {
 
 const int MAX_SERVER_SUPPORTED = 16;
 typedef RUDQP<default_ud_config,MAX_SERVER_SUPPORTED> UDQP;
 typedef RRCQP<default_rc_config>                      RCQP;
+typedef RUCQP<default_uc_config>                      UCQP;
+typedef RSharedQP<RCQP>                               SharedRCQP;
 
 typedef std::function<void (const QPConnArg &)>     connection_callback_t;
 
@@ -86,16 +90,36 @@ class RdmaCtrl {
    */
   int get_default_mr(MemoryAttr &attr);
 
+  /**
+   * Record (or remove) the multicast group joined by a local worker,
+   * so that the remotes can query the membership (see UDAdapter::join_group)
+   */
+  void register_group(uint32_t group_id,int worker_id);
+
+  void unregister_group(uint32_t group_id,int worker_id);
+
   /**
    * Create and query QPs
    * For create, an optional local_attr can be provided to bind to this QP
    * A local MR is passed as the default local mr for this QP.
    * If local_attr = nullptr, then this QP is unbind to any MR.
+   * An RC QP can optionally take its receives from a shared receive queue (srq),
+   * whose completions are reported to recv_cq.
    */
-  RCQP *create_rc_qp(QPIdx idx, RNicHandler *dev,MemoryAttr *local_attr = NULL);
+  RCQP *create_rc_qp(QPIdx idx, RNicHandler *dev,MemoryAttr *local_attr = NULL,
+                     ibv_cq *recv_cq = NULL,ibv_srq *srq = NULL);
+  UCQP *create_uc_qp(QPIdx idx, RNicHandler *dev,MemoryAttr *local_attr = NULL);
   UDQP *create_ud_qp(QPIdx idx, RNicHandler *dev,MemoryAttr *local_attr = NULL);
 
+  /**
+   * Create (or get) the RC QP shared by a group of threads_per_qp workers.
+   * Worker idx.worker_id belongs to the group (idx.worker_id / threads_per_qp);
+   * the remote shall use the same threads_per_qp, so that the groups are connected symmetrically.
+   */
+  SharedRCQP *create_shared_rc_qp(QPIdx idx, RNicHandler *dev,MemoryAttr *local_attr,int threads_per_qp);
+
   RCQP *get_rc_qp(QPIdx idx);
+  UCQP *get_uc_qp(QPIdx idx);
   UDQP *get_ud_qp(QPIdx idx);
 
   /**
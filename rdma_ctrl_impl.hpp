@@ -1,5 +1,6 @@
 #include <pthread.h>
 #include <map>
+#include <set>
 #include <mutex>
 
 namespace rdmaio {
@@ -33,6 +34,10 @@ inline uint32_t get_rc_key (const QPIdx idx) {
   return ::rdmaio::encode_qp_id(idx.node_id,RC_ID_BASE + idx.worker_id * 64 + idx.index);
 }
 
+inline uint32_t get_uc_key (const QPIdx idx) {
+  return ::rdmaio::encode_qp_id(idx.node_id,UC_ID_BASE + idx.worker_id * 64 + idx.index);
+}
+
 inline uint32_t get_ud_key(const QPIdx idx) {
   return ::rdmaio::encode_qp_id(idx.worker_id,UD_ID_BASE + idx.index);
 }
@@ -129,6 +134,15 @@ class RdmaCtrl::RdmaCtrlImpl {
     return res;
   }
 
+  UCQP *get_uc_qp(QPIdx idx) {
+    UCQP *res = nullptr;
+    {
+      SCS s;
+      res = get_qp<UCQP,get_uc_key>(idx);
+    };
+    return res;
+  }
+
   UDQP *get_ud_qp(QPIdx idx) {
 
     UDQP *res = nullptr;
@@ -151,7 +165,7 @@ class RdmaCtrl::RdmaCtrlImpl {
       return dynamic_cast<T *>(qps_[key]);
   }
 
-  RCQP *create_rc_qp(QPIdx idx, RNicHandler *dev,MemoryAttr *attr) {
+  RCQP *create_rc_qp(QPIdx idx, RNicHandler *dev,MemoryAttr *attr,ibv_cq *recv_cq = NULL,ibv_srq *srq = NULL) {
 
     RCQP *res = nullptr;
     {
@@ -160,7 +174,10 @@ class RdmaCtrl::RdmaCtrlImpl {
       if(qps_.find(qid) != qps_.end()) {
         res = dynamic_cast<RCQP *>(qps_[qid]);
       } else {
-        if(attr == NULL)
+        if(srq != NULL) {
+          RDMA_ASSERT(attr != NULL) << "a QP using shared receive queue must bind a local mr.";
+          res = new RCQP(dev,idx,*attr,recv_cq,srq);
+        } else if(attr == NULL)
           res = new RCQP(dev,idx);
         else
           res = new RCQP(dev,idx,*attr);
@@ -170,6 +187,45 @@ class RdmaCtrl::RdmaCtrlImpl {
     return res;
   }
 
+  SharedRCQP *create_shared_rc_qp(QPIdx idx, RNicHandler *dev,MemoryAttr *attr,int threads_per_qp) {
+
+    QPIdx group_idx = {.node_id = idx.node_id,.worker_id = idx.worker_id / threads_per_qp,.index = SharedRCQP::QP_IDX };
+    RCQP *qp = create_rc_qp(group_idx,dev,attr);
+
+    SharedRCQP *res = nullptr;
+    {
+      SCS s;
+      uint64_t qid = get_rc_key(group_idx);
+      if(shared_qps_.find(qid) != shared_qps_.end()) {
+        res = shared_qps_[qid];
+        RDMA_ASSERT(res->max_threads() == threads_per_qp) << "inconsistent threads per shared qp.";
+      } else {
+        res = new SharedRCQP(qp,threads_per_qp);
+        shared_qps_.insert(std::make_pair(qid,res));
+      }
+    };
+    return res;
+  }
+
+  UCQP *create_uc_qp(QPIdx idx, RNicHandler *dev,MemoryAttr *attr) {
+
+    UCQP *res = nullptr;
+    {
+      SCS s;
+      uint64_t qid = get_uc_key(idx);
+      if(qps_.find(qid) != qps_.end()) {
+        res = dynamic_cast<UCQP *>(qps_[qid]);
+      } else {
+        if(attr == NULL)
+          res = new UCQP(dev,idx);
+        else
+          res = new UCQP(dev,idx,*attr);
+        qps_.insert(std::make_pair(qid,res));
+      }
+    };
+    return res;
+  }
+
   UDQP *create_ud_qp(QPIdx idx, RNicHandler *dev,MemoryAttr *attr) {
 
     UDQP *res = nullptr;
@@ -370,6 +426,11 @@ class RdmaCtrl::RdmaCtrlImpl {
               reply.ack = SUCC;
             };
             break;
+          case ConnArg::GROUP:
+            if(groups_.find(group_key(arg.payload.group.group_id,arg.payload.group.worker_id)) != groups_.end())
+              reply.ack = SUCC;
+            reply.payload.node_id = node_id_;
+            break;
           case ConnArg::QP: {
             qp_callback_(arg.payload.qp); // call the user callback
             QP *qp = NULL;
@@ -386,10 +447,30 @@ class RdmaCtrl::RdmaCtrlImpl {
               case IBV_QPT_RC:
                 {
                   RCQP *rc_qp = get_qp<RCQP,get_rc_key>(
-                      create_rc_idx(arg.payload.qp.from_node,arg.payload.qp.from_worker));
+                      QPIdx {.node_id   = arg.payload.qp.from_node,
+                             .worker_id = arg.payload.qp.from_worker,
+                             .index     = arg.payload.qp.from_index });
+                  // the remote is recovering its QP, so the local one shall be reset as well;
+                  // NOT_READY until it is reset, if its owner is using it
+                  if(rc_qp != nullptr && arg.payload.qp.reset) {
+                    auto ret = rc_qp->reset_by_peer(arg.payload.qp.attr,arg.payload.qp.reset);
+                    if(ret != SUCC) {
+                      reply.ack = ret;
+                      rc_qp = nullptr;
+                    }
+                  }
                   qp = rc_qp;
                 }
                 break;
+              case IBV_QPT_UC:
+                {
+                  UCQP *uc_qp = get_qp<UCQP,get_uc_key>(
+                      QPIdx {.node_id   = arg.payload.qp.from_node,
+                             .worker_id = arg.payload.qp.from_worker,
+                             .index     = arg.payload.qp.from_index });
+                  qp = uc_qp;
+                }
+                break;
               default:
                 RDMA_LOG(ERROR) << "unknown QP connection type: " << arg.payload.qp.qp_type;
             }
@@ -426,6 +507,14 @@ class RdmaCtrl::RdmaCtrlImpl {
 
   // created QPs on this control manager
   std::map<uint64_t,QP *> qps_;
+  std::map<uint64_t,SharedRCQP *> shared_qps_;
+
+  // multicast groups joined by the local workers
+  std::set<uint64_t> groups_;
+
+  static inline uint64_t group_key(uint32_t group_id,int worker_id) {
+    return ((uint64_t)group_id << 8) | (uint8_t)worker_id;
+  }
 
   // local node information
   const int node_id_;
@@ -490,6 +579,16 @@ class RdmaCtrl::RdmaCtrlImpl {
   void register_qp_callback(connection_callback_t callback) {
     qp_callback_ = callback;
   }
+
+  void register_group(uint32_t group_id,int worker_id) {
+    SCS s;
+    groups_.insert(group_key(group_id,worker_id));
+  }
+
+  void unregister_group(uint32_t group_id,int worker_id) {
+    SCS s;
+    groups_.erase(group_key(group_id,worker_id));
+  }
 }; //
 
 // link to the main class
@@ -559,8 +658,19 @@ int RdmaCtrl::get_default_mr(MemoryAttr &attr) {
 }
 
 inline __attribute__ ((always_inline))
-RCQP *RdmaCtrl::create_rc_qp(QPIdx idx, RNicHandler *dev,MemoryAttr *attr) {
-  return impl_->create_rc_qp(idx,dev,attr);
+RCQP *RdmaCtrl::create_rc_qp(QPIdx idx, RNicHandler *dev,MemoryAttr *attr,
+                             ibv_cq *recv_cq,ibv_srq *srq) {
+  return impl_->create_rc_qp(idx,dev,attr,recv_cq,srq);
+}
+
+inline __attribute__ ((always_inline))
+SharedRCQP *RdmaCtrl::create_shared_rc_qp(QPIdx idx, RNicHandler *dev,MemoryAttr *attr,int threads_per_qp) {
+  return impl_->create_shared_rc_qp(idx,dev,attr,threads_per_qp);
+}
+
+inline __attribute__ ((always_inline))
+UCQP *RdmaCtrl::create_uc_qp(QPIdx idx, RNicHandler *dev,MemoryAttr *attr) {
+  return impl_->create_uc_qp(idx,dev,attr);
 }
 
 inline __attribute__ ((always_inline))
@@ -573,6 +683,11 @@ RCQP *RdmaCtrl::get_rc_qp(QPIdx idx) {
   return impl_->get_rc_qp(idx);
 }
 
+inline __attribute__ ((always_inline))
+UCQP *RdmaCtrl::get_uc_qp(QPIdx idx) {
+  return impl_->get_uc_qp(idx);
+}
+
 inline __attribute__ ((always_inline))
 UDQP *RdmaCtrl::get_ud_qp(QPIdx idx) {
   return impl_->get_ud_qp(idx);
@@ -604,4 +719,14 @@ void RdmaCtrl::register_qp_callback(connection_callback_t callback) {
   impl_->register_qp_callback(callback);
 }
 
+inline __attribute__ ((always_inline))
+void RdmaCtrl::register_group(uint32_t group_id,int worker_id) {
+  impl_->register_group(group_id,worker_id);
+}
+
+inline __attribute__ ((always_inline))
+void RdmaCtrl::unregister_group(uint32_t group_id,int worker_id) {
+  impl_->unregister_group(group_id,worker_id);
+}
+
 };
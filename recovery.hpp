@@ -0,0 +1,153 @@
+#pragma once
+
+#include <vector>
+#include <infiniband/verbs.h>
+
+#include "common.hpp"
+#include "qp_impl.hpp"
+
+namespace rdmaio {
+
+/**
+ * What to do with the outstanding requests of a QP once it is recovered.
+ * FAIL_OUTSTANDING:   signaled ones are completed with IBV_WC_WR_FLUSH_ERR;
+ * REPLAY_OUTSTANDING: they are posted again to the recovered QP, including the failed one
+ *                     if it failed because of the transport (retry exceeded).
+ */
+enum RecoveryPolicy {
+  FAIL_OUTSTANDING   = 0,
+  REPLAY_OUTSTANDING = 1
+};
+
+/**
+ * The requests posted to a QP which have not completed.
+ * A recorded request is posted with an internal wr_id (the sequence of the request), so that its completion
+ * retires all requests before it, since an RC QP completes requests in order.
+ * Inlined payloads are copied, because the user can reuse the buffer right after posting.
+ */
+class RecoveryLog {
+ public:
+  static const uint64_t WR_ID_BASE = 0x4ec0000000000000ULL;
+  static const uint64_t WR_ID_MASK = 0xffffffffULL;
+
+  struct Entry {
+    struct ibv_send_wr sr;
+    struct ibv_sge     sge;
+    char inline_data[MAX_INLINE_SIZE];
+  };
+
+  RecoveryLog(RecoveryPolicy policy,int capacity):
+      policy_(policy),
+      entries_(capacity)
+  {
+  }
+
+  inline RecoveryPolicy policy() const {
+    return policy_;
+  }
+
+  // whether an error completion has been polled since the last recovery
+  inline bool failed() const {
+    return failed_;
+  }
+
+  inline uint64_t outstanding() const {
+    return head_ - tail_;
+  }
+
+  /**
+   * Record the request (with one SGE at most), and replace its wr_id with the internal one.
+   * return false if there are too many outstanding requests.
+   */
+  bool record(struct ibv_send_wr *sr) {
+
+    if(head_ - tail_ >= entries_.size())
+      return false;
+
+    Entry &e = entries_[head_ % entries_.size()];
+    e.sr = *sr;
+    e.sr.next = nullptr;
+    if(sr->num_sge > 0) {
+      e.sge = sr->sg_list[0];
+      e.sr.sg_list = &e.sge;
+      e.sr.num_sge = 1;
+      if((sr->send_flags & IBV_SEND_INLINE) && e.sge.length <= MAX_INLINE_SIZE) {
+        memcpy(e.inline_data,(char *)e.sge.addr,e.sge.length);
+        e.sge.addr = (uint64_t)e.inline_data;
+      }
+    }
+    sr->wr_id = WR_ID_BASE | (head_ & WR_ID_MASK);
+    head_ += 1;
+    return true;
+  }
+
+  /**
+   * Drop the latest num records, whose requests fail to post
+   */
+  void cancel(int num) {
+    head_ -= num;
+  }
+
+  inline uint64_t user_wr_id(uint64_t wr_id) {
+    return entries_[(wr_id & WR_ID_MASK) % entries_.size()].sr.wr_id;
+  }
+
+  /**
+   * Handle a completion polled from the QP's CQ, whose wr_id is restored to the user's one.
+   * return true if the completion shall not be passed to the user,
+   * which are the flushed requests to be handled at recovery.
+   */
+  bool on_completion(ibv_wc &wc) {
+
+    if((wc.wr_id & ~WR_ID_MASK) != WR_ID_BASE)
+      return false;
+
+    uint64_t seq = seq_of(wc.wr_id);
+    wc.wr_id = user_wr_id(seq);
+
+    if(failed_)
+      return true;  // requests after the failed one are flushed
+
+    if(wc.status == IBV_WC_SUCCESS) {
+      tail_ = seq + 1;
+      return false;
+    }
+
+    // the first error: requests before it have completed
+    failed_ = true;
+    tail_   = seq;
+    if(policy_ == REPLAY_OUTSTANDING &&
+       (wc.status == IBV_WC_RETRY_EXC_ERR || wc.status == IBV_WC_RNR_RETRY_EXC_ERR))
+      return true;  // it will be replayed
+    tail_ = seq + 1;
+    return false;
+  }
+
+  /**
+   * Take the outstanding requests once the QP is recovered
+   */
+  std::vector<Entry> take_outstanding() {
+    std::vector<Entry> res;
+    for(uint64_t i = tail_;i < head_;++i)
+      res.push_back(entries_[i % entries_.size()]);
+    tail_   = head_;
+    failed_ = false;
+    return res;
+  }
+
+ private:
+  const RecoveryPolicy policy_;
+  std::vector<Entry>   entries_;
+
+  uint64_t head_ = 0;   // sequence of the next request
+  uint64_t tail_ = 0;   // requests before it have completed
+  bool failed_ = false;
+
+  // the wr_id only carries the lower bits of the sequence
+  inline uint64_t seq_of(uint64_t wr_id) const {
+    uint64_t seq = (head_ & ~WR_ID_MASK) | (wr_id & WR_ID_MASK);
+    return (seq > head_) ? seq - (WR_ID_MASK + 1) : seq;
+  }
+};
+
+} // namespace rdmaio
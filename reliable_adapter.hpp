@@ -0,0 +1,313 @@
+#pragma once
+
+#include <memory>
+#include <deque>
+#include <vector>
+
+#include "ud_adapter.hpp"
+
+/**
+ * Reliable messaging over UDAdapter, in the style of eRPC.
+ * Each message is copied (with a Header) into a buffer from the registered heap, which is kept until
+ * the message is acknowledged, and retransmitted if it is not acknowledged within the RTO.
+ * A retransmitted buffer may still be read by a posted send once acknowledged; it is freed in poll_comps
+ * after that send completes.
+ *
+ * - Messages to a peer carry sequence numbers, starting at 1 (0 marks an ACK-only packet).
+ * - Every packet carries the receiver's cumulative ACK (the next expected sequence), and a 64-bit SACK
+ *   bitmap of the sequences received beyond it, so only the lost messages are retransmitted.
+ * - ACKs are piggybacked on the messages to the peer; otherwise one ACK-only packet is sent
+ *   per ACK_BATCH messages received, or ACK_DELAY_US after the first one not acknowledged.
+ * - The receiver delivers a message once, as soon as it arrives; duplicates are dropped.
+ *   Like UD, messages are not ordered.
+ * At most WINDOW messages to a peer are unacknowledged; send_to returns NOT_READY beyond it.
+ * With congestion control enabled, the time from sending a message (not retransmitted) to its ACK
+ * is the RTT sample of the peer, and the ACKs are no longer delayed, so the samples stay accurate.
+ * Both sides shall use the same worker id, and connect to each other.
+ */
+namespace rdmaio {
+
+class ReliableAdapter : public MsgAdapter {
+ public:
+  static const int WINDOW         = 64;
+  static const int DEFAULT_RTO_US = 1000;
+  static const int ACK_BATCH      = 16;
+  static const int ACK_DELAY_US   = 20;
+
+  struct Header {
+    uint32_t seq;
+    uint32_t ack;
+    uint64_t sack;
+  };
+
+  ReliableAdapter(std::shared_ptr<RdmaCtrl> cm, RNicHandler *rnic, MemoryAttr local_mr,
+                  int w_id, int max_recv_num,int rto_us = DEFAULT_RTO_US):
+      ud_(new UDAdapter(cm,rnic,local_mr,w_id,max_recv_num)),
+      rto_ns_(rto_us * 1000ULL),
+      clock_ns_(PathMonitor::now_ns())
+  {
+    ud_->set_callback([this](const char *msg,int node_id,int tid) {
+        this->on_recv(msg,node_id,tid);
+      });
+  }
+
+  ~ReliableAdapter() {
+    for(auto &p : peers_) {
+      for(auto &e : p.unacked) {
+        if(e.buf != nullptr)
+          Rfree(e.buf);
+      }
+    }
+    for(auto &g : retired_)
+      Rfree(g.second);
+  }
+
+  ConnStatus connect(std::string ip,int port) {
+    int node_id;
+    auto ret = ud_->connect(ip,port,&node_id);
+    if(ret == SUCC)
+      peer(node_id);
+    return ret;
+  }
+
+  /**
+   * return NOT_READY if there are WINDOW unacknowledged messages to the node; the caller shall poll and retry.
+   */
+  ConnStatus send_to(int node_id,const char *msg,int len) {
+    return send(node_id,msg,len,false);
+  }
+
+  void prepare_pending() {
+    ud_->prepare_pending();
+  }
+
+  ConnStatus send_pending(int node_id,const char *msg,int len) {
+    return send(node_id,msg,len,true);
+  }
+
+  ConnStatus flush_pending() {
+    return ud_->flush_pending();
+  }
+
+  void poll_comps() {
+    clock_ns_ = PathMonitor::now_ns();
+    ud_->poll_comps();
+    if(!owing_.empty())
+      send_acks();
+    if(!retired_.empty())
+      free_retired();
+    if((++polls_ % 64) == 0)
+      retransmit();
+  }
+
+  void enable_congestion_control(const CCConfig &config = default_cc_config()) {
+    ud_->enable_congestion_control(config);
+    ack_delay_ns_ = 0;
+  }
+
+  inline uint64_t retransmits() const {
+    return retransmits_;
+  }
+
+  inline uint64_t duplicates() const {
+    return duplicates_;
+  }
+
+ private:
+  struct Entry {
+    uint32_t seq;
+    char    *buf;      // nullptr once selectively acknowledged
+    int      len;
+    uint64_t send_ns;
+    int      retries;
+  };
+
+  struct Peer {
+    // sender side
+    uint32_t next_seq = 1;
+    std::deque<Entry> unacked;
+
+    // receiver side
+    uint32_t expected = 1;   // the next sequence expected
+    uint64_t received = 0;   // bit i: expected + i has been received
+    int      acks_owed = 0;  // messages received, which have not been acknowledged
+    uint64_t owed_since_ns = 0;
+    bool     owing = false;  // whether it is in owing_
+  };
+
+  std::unique_ptr<UDAdapter> ud_;
+  const uint64_t rto_ns_;
+  uint64_t ack_delay_ns_ = ACK_DELAY_US * 1000ULL;
+
+  std::vector<Peer> peers_;
+  std::vector<int>  owing_;  // peers which may owe ACKs
+
+  // buffers retransmitted & acknowledged, with the WR number they wait to complete
+  std::deque<std::pair<uint64_t,char *> > retired_;
+
+  uint64_t clock_ns_;      // updated once per poll
+  uint64_t polls_ = 0;
+  uint64_t retransmits_ = 0;
+  uint64_t duplicates_  = 0;
+
+  inline Peer &peer(int node_id) {
+    if((size_t)node_id >= peers_.size())
+      peers_.resize(node_id + 1);
+    return peers_[node_id];
+  }
+
+  // sequence comparison, which is safe across the wrap
+  static inline int32_t seq_diff(uint32_t a,uint32_t b) {
+    return (int32_t)(a - b);
+  }
+
+  inline void fill_ack(Peer &p,Header &h) {
+    h.ack  = p.expected;
+    h.sack = p.received;
+    p.acks_owed = 0;  // piggybacked
+  }
+
+  ConnStatus send(int node_id,const char *msg,int len,bool pending) {
+
+    Peer &p = peer(node_id);
+    if(p.unacked.size() >= WINDOW)
+      return NOT_READY;
+
+    char *buf = (char *)Rmalloc(len + sizeof(Header));
+    if(buf == nullptr)
+      return ERR;
+    Header *h = (Header *)buf;
+    h->seq = p.next_seq++;
+    fill_ack(p,*h);
+    memcpy(buf + sizeof(Header),msg,len);
+
+    p.unacked.push_back({ .seq = h->seq,.buf = buf,.len = (int)(len + sizeof(Header)),
+                          .send_ns = clock_ns_,.retries = 0 });
+    return pending ? ud_->send_pending(node_id,buf,len + sizeof(Header))
+        : ud_->send_to(node_id,buf,len + sizeof(Header));
+  }
+
+  void on_recv(const char *msg,int node_id,int tid) {
+
+    const Header *h = (const Header *)msg;
+    Peer &p = peer(node_id);
+    on_ack(node_id,p,h->ack,h->sack);
+    if(h->seq == 0)
+      return;  // ACK-only
+
+    int32_t d = seq_diff(h->seq,p.expected);
+    if(d >= WINDOW)
+      return;  // cannot happen with the sender's window; it will be retransmitted anyway
+    if(d < 0 || ((p.received >> d) & 1)) {
+      duplicates_ += 1;
+      owe_ack(node_id,p);  // the previous ACK may be lost
+      return;
+    }
+    p.received |= 1ULL << d;
+    while(p.received & 1) {
+      p.received >>= 1;
+      p.expected += 1;
+    }
+    owe_ack(node_id,p);
+    callback_(msg + sizeof(Header),node_id,tid);
+  }
+
+  void on_ack(int node_id,Peer &p,uint32_t ack,uint64_t sack) {
+
+    uint64_t sent_ns = 0;  // of the latest message acknowledged, which has not been retransmitted
+    size_t retired = retired_.size();
+    while(!p.unacked.empty() && seq_diff(p.unacked.front().seq,ack) < 0) {
+      release(p.unacked.front(),sent_ns);
+      p.unacked.pop_front();
+    }
+    if(sack != 0) {
+      for(auto &e : p.unacked) {
+        int32_t d = seq_diff(e.seq,ack);
+        if(d >= 64)
+          break;
+        if(e.buf != nullptr && ((sack >> d) & 1)) {
+          release(e,sent_ns);
+          e.buf = nullptr;
+        }
+      }
+    }
+    if(sent_ns != 0)
+      ud_->rtt_sample(node_id,clock_ns_ - sent_ns);
+
+    // the last sends of the retired buffers may be unsignaled, so a signaled ACK-only packet follows them;
+    // its completion frees them, even if nothing else is sent
+    if(retired_.size() > retired) {
+      Header h = { .seq = 0,.ack = 0,.sack = 0 };
+      fill_ack(p,h);
+      auto ret = ud_->send_to_tracked(node_id,(char *)(&h),sizeof(Header),0);
+      RDMA_VERIFY(WARNING,ret == SUCC) << "send ACK to " << node_id << " error: " << ret;
+    }
+  }
+
+  void release(Entry &e,uint64_t &sent_ns) {
+    if(e.buf == nullptr)
+      return;
+    if(e.retries == 0)
+      sent_ns = std::max(sent_ns,e.send_ns);
+    if(e.retries == 0) {
+      // the acknowledged transmission is the only one, which has been sent
+      Rfree(e.buf);
+      return;
+    }
+    retired_.push_back(std::make_pair(ud_->posted_wrs(),e.buf));
+  }
+
+  // free the retired buffers whose sends have completed
+  void free_retired() {
+    while(!retired_.empty() && ud_->completed_wrs() >= retired_.front().first) {
+      Rfree(retired_.front().second);
+      retired_.pop_front();
+    }
+  }
+
+  inline void owe_ack(int node_id,Peer &p) {
+    if(p.acks_owed++ == 0)
+      p.owed_since_ns = clock_ns_;
+    if(!p.owing) {
+      p.owing = true;
+      owing_.push_back(node_id);
+    }
+  }
+
+  // send the ACK-only packets which are due, and keep the others owing
+  void send_acks() {
+    uint i = 0;
+    for(uint j = 0;j < owing_.size();++j) {
+      Peer &p = peers_[owing_[j]];
+      if(p.acks_owed > 0 && p.acks_owed < ACK_BATCH && clock_ns_ - p.owed_since_ns < ack_delay_ns_) {
+        owing_[i++] = owing_[j];
+        continue;
+      }
+      p.owing = false;
+      if(p.acks_owed == 0)
+        continue;  // piggybacked
+      Header h = { .seq = 0,.ack = 0,.sack = 0 };
+      fill_ack(p,h);
+      auto ret = ud_->send_to(owing_[j],(char *)(&h),sizeof(Header));
+      RDMA_VERIFY(WARNING,ret == SUCC) << "send ACK to " << owing_[j] << " error: " << ret;
+    }
+    owing_.resize(i);
+  }
+
+  void retransmit() {
+    for(uint n = 0;n < peers_.size();++n) {
+      Peer &p = peers_[n];
+      for(auto &e : p.unacked) {
+        if(e.buf == nullptr || clock_ns_ - e.send_ns < rto_ns_)
+          continue;
+        auto ret = ud_->send_to(n,e.buf,e.len);
+        RDMA_VERIFY(WARNING,ret == SUCC) << "retransmit message " << e.seq << " to " << n << " error: " << ret;
+        e.send_ns  = clock_ns_;
+        e.retries += 1;
+        retransmits_ += 1;
+      }
+    }
+  }
+};
+
+} // namespace rdmaio
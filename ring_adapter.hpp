@@ -0,0 +1,299 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <string>
+
+#include "msg_interface.hpp"
+#include "rdma_ctrl.hpp"
+
+/**
+ * The Adapter use one-sided RDMA writes to a ring buffer at the receiver, which is based on FaRM's messaging.
+ * The receiver polls the ring memory, so no recv WQE & recv CQ is needed.
+ *
+ * All nodes use the same layout of the region, starting at base_off of the registered MR (mr_id):
+ *   | recv rings [max_nodes] | send rings [max_nodes] | head slots [max_nodes] |
+ * - recv ring i is written by node i;
+ * - send ring i mirrors the recv ring at node i. A message is composed at the same offset as it will be
+ *   in the remote ring, so the local buffer is reusable once the remote ring space has been consumed;
+ * - head slot i is written by node i, which tells how many bytes of my ring at node i have been consumed.
+ *
+ * A message in the ring is | header | payload (8-byte aligned) | canary |.
+ * The receiver treats the message as arrived once both the header and the trailing canary are written,
+ * which assumes that the RNIC writes a message in increasing address order (as FaRM does).
+ */
+namespace rdmaio {
+
+class RingAdapter : public MsgAdapter {
+ public:
+  static const int DEFAULT_RING_SIZE = 64 * 1024;
+  // the QP index reserved for RingAdapter's QPs
+  static const int QP_IDX = 62;
+
+  struct RingHeader {
+    uint32_t len;   // payload length, with flags
+    uint32_t ack;   // piggybacked consumed bytes of the reverse ring
+  };
+
+  static const uint32_t VALID_FLAG = 1u << 31;
+  static const uint32_t PAD_FLAG   = 1u << 30; // skip to the start of the ring
+  static const uint64_t CANARY     = 0x5a5a5a5adeadbeafULL;
+
+  /**
+   * The size of the region used by one RingAdapter
+   */
+  static uint64_t region_size(int max_nodes,int ring_size = DEFAULT_RING_SIZE) {
+    return (uint64_t)max_nodes * (2 * (uint64_t)ring_size + sizeof(uint64_t));
+  }
+
+  RingAdapter(std::shared_ptr<RdmaCtrl> cm, RNicHandler *rnic, int mr_id, uint64_t base_off,
+              int w_id, int max_nodes,int ring_size = DEFAULT_RING_SIZE):
+      cm_(cm),
+      rnic_(rnic),
+      mr_id_(mr_id),
+      local_mr_(cm->get_local_mr(mr_id)),
+      base_off_(base_off),
+      node_id_(cm->current_node_id()),
+      worker_id_(w_id),
+      max_nodes_(max_nodes),
+      ring_size_(ring_size),
+      peers_(max_nodes)
+  {
+    RDMA_ASSERT(ring_size_ % sizeof(uint64_t) == 0) << "ring size must be 8-byte aligned.";
+    RDMA_ASSERT(node_id_ < max_nodes_);
+    memset(region(),0,region_size(max_nodes_,ring_size_));
+  }
+
+  /**
+   * Connect to the RingAdapter of the same worker id at the remote.
+   * return NOT_READY if the remote has not created its QP yet; the caller shall retry.
+   */
+  ConnStatus connect(std::string ip,int port) {
+
+    MemoryAttr remote_mr;
+    auto ret = QPImpl::get_remote_mr(ip,port,mr_id_,&remote_mr);
+    if(ret != SUCC)
+      return ret;
+
+    ConnArg arg = {}; ConnReply reply = {};
+    arg.type = ConnArg::QP;
+    arg.payload.qp.from_node   = node_id_;
+    arg.payload.qp.from_worker = worker_id_;
+    arg.payload.qp.from_index  = QP_IDX;
+    arg.payload.qp.qp_type     = IBV_QPT_RC;
+
+    ret = QPImpl::get_remote_helper(&arg,&reply,ip,port);
+    if(ret != SUCC && ret != NOT_READY)
+      return ret;
+
+    int node_id = reply.payload.qp.node_id;
+    if(node_id >= max_nodes_) {
+      RDMA_LOG(WARNING) << "node " << node_id << " exceeds the max nodes " << max_nodes_;
+      return WRONG_ARG;
+    }
+
+    Peer &p = peers_[node_id];
+    if(p.qp == nullptr)
+      p.qp = cm_->create_rc_qp(QPIdx {.node_id = node_id,.worker_id = worker_id_,.index = QP_IDX },
+                               rnic_,&local_mr_);
+    if(ret == SUCC)
+      ret = p.qp->connect(reply.payload.qp);
+    if(ret == SUCC && !p.connected) {
+      p.remote_mr = remote_mr;
+      p.connected = true;
+      connected_.push_back(node_id);
+    }
+    return ret;
+  }
+
+  /**
+   * If the remote ring is full, the message is queued locally, and sent in a later poll_comps.
+   * An entry is at most a quarter of the ring, since the receiver reports its head once a quarter is consumed;
+   * so a blocked sender always learns enough space for the entry (and the padding before it).
+   */
+  ConnStatus send_to(int node_id,const char *msg,int len) {
+
+    if(node_id >= max_nodes_ || !peers_[node_id].connected)
+      return NOT_READY;
+    if(entry_size(len) > ring_size_ / 4)
+      return WRONG_ARG;
+
+    Peer &p = peers_[node_id];
+    if(!p.overflow.empty() || !try_send(node_id,p,msg,len)) {
+      p.overflow.emplace_back(msg,len);
+    }
+    return SUCC;
+  }
+
+  ConnStatus send_pending(int node_id,const char *msg,int len) {
+    return send_to(node_id,msg,len);
+  }
+
+  /**
+   * Scan the rings of all connected nodes
+   */
+  void poll_comps() {
+
+    for(uint i = 0;i < connected_.size();++i) {
+
+      int node_id = connected_[i];
+      Peer &p = peers_[node_id];
+      char *ring  = recv_ring(node_id);
+
+      while(true) {
+        uint64_t pos = p.consumed % ring_size_;
+        volatile RingHeader *header = (volatile RingHeader *)(ring + pos);
+        uint32_t len = header->len;
+
+        if(!(len & VALID_FLAG))
+          break;
+
+        if(len & PAD_FLAG) {
+          update_head(p,header->ack);
+          *((volatile uint64_t *)header) = 0;
+          p.consumed += ring_size_ - pos;
+          continue;
+        }
+
+        len &= ~VALID_FLAG;
+        uint64_t entry = entry_size(len);
+        if(*((volatile uint64_t *)(ring + pos + entry - sizeof(uint64_t))) != CANARY)
+          break; // the payload has not been fully written
+        asm volatile("" ::: "memory");
+
+        update_head(p,header->ack);
+        callback_(ring + pos + sizeof(RingHeader),node_id,worker_id_);
+
+        memset(ring + pos,0,entry);
+        p.consumed += entry;
+      }
+
+      // if there is no reverse traffic to carry the head, write it to the sender explicitly
+      if(p.consumed - p.acked >= ring_size_ / 4) {
+        uint64_t consumed = p.consumed;
+        post_write(p,(char *)(&consumed),sizeof(uint64_t),head_slot_off(node_id_),IBV_SEND_INLINE);
+        p.acked = p.consumed;
+      }
+
+      while(!p.overflow.empty() && try_send(node_id,p,p.overflow.front().data(),p.overflow.front().size()))
+        p.overflow.pop_front();
+    }
+  }
+
+  int msg_meta_len() {
+    return sizeof(RingHeader) + sizeof(uint64_t);
+  }
+
+ private:
+  struct Peer {
+    RCQP *qp = nullptr;
+    MemoryAttr remote_mr;
+    bool connected = false;
+
+    uint64_t tail = 0;      // bytes written to my ring at the peer
+    uint64_t head = 0;      // bytes of my ring at the peer which are known to be consumed
+    uint64_t consumed = 0;  // bytes consumed from the peer's ring
+    uint64_t acked = 0;     // consumed bytes which have been reported to the peer
+
+    std::deque<std::string> overflow; // messages waiting for ring space
+  };
+
+  std::shared_ptr<RdmaCtrl> cm_;
+  RNicHandler *rnic_;
+  const int    mr_id_;
+  MemoryAttr   local_mr_;
+  const uint64_t base_off_;
+
+  const int node_id_;   // my node id
+  const int worker_id_; // my thread id
+  const int max_nodes_;
+  const uint64_t ring_size_;
+
+  std::vector<Peer> peers_;
+  std::vector<int>  connected_;
+
+  inline uint64_t entry_size(int len) const {
+    return sizeof(RingHeader) + ((len + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1)) + sizeof(uint64_t);
+  }
+
+  inline char *region() {
+    return (char *)(local_mr_.buf + base_off_);
+  }
+
+  inline char *recv_ring(int node_id) {
+    return region() + node_id * ring_size_;
+  }
+
+  inline char *send_ring(int node_id) {
+    return region() + (max_nodes_ + node_id) * ring_size_;
+  }
+
+  // offsets relative to the MR, which are the same at all nodes
+  inline uint64_t recv_ring_off(int node_id) const {
+    return base_off_ + node_id * ring_size_;
+  }
+
+  inline uint64_t head_slot_off(int node_id) const {
+    return base_off_ + 2 * max_nodes_ * ring_size_ + node_id * sizeof(uint64_t);
+  }
+
+  inline void update_head(Peer &p,uint32_t ack) {
+    int32_t diff = (int32_t)(ack - (uint32_t)p.head);
+    if(diff > 0)
+      p.head += diff;
+  }
+
+  inline uint64_t refresh_head(int node_id,Peer &p) {
+    uint64_t slot = *((volatile uint64_t *)(region() + head_slot_off(node_id) - base_off_));
+    if(slot > p.head)
+      p.head = slot;
+    return p.head;
+  }
+
+  bool try_send(int node_id,Peer &p,const char *msg,int len) {
+
+    uint64_t entry = entry_size(len);
+    uint64_t pos   = p.tail % ring_size_;
+    uint64_t pad   = (pos + entry > ring_size_) ? (ring_size_ - pos) : 0;
+
+    if(p.tail + pad + entry - refresh_head(node_id,p) > ring_size_)
+      return false;
+
+    char *local = send_ring(node_id);
+    if(pad > 0) {
+      RingHeader *header = (RingHeader *)(local + pos);
+      header->len = VALID_FLAG | PAD_FLAG;
+      header->ack = (uint32_t)p.consumed;
+      post_write(p,local + pos,sizeof(RingHeader),recv_ring_off(node_id_) + pos,IBV_SEND_INLINE);
+      p.tail += pad;
+      pos = 0;
+    }
+
+    RingHeader *header = (RingHeader *)(local + pos);
+    header->len = VALID_FLAG | len;
+    header->ack = (uint32_t)p.consumed;
+    p.acked = p.consumed;
+
+    memcpy(local + pos + sizeof(RingHeader),msg,len);
+    *((uint64_t *)(local + pos + entry - sizeof(uint64_t))) = CANARY;
+
+    post_write(p,local + pos,entry,recv_ring_off(node_id_) + pos,(entry < MAX_INLINE_SIZE) ? IBV_SEND_INLINE : 0);
+    p.tail += entry;
+    return true;
+  }
+
+  void post_write(Peer &p,char *local_buf,int len,uint64_t remote_off,int flags) {
+    RCQP *qp = p.qp;
+    if(qp->need_poll()) {
+      ibv_wc wc; auto ret = qp->poll_till_completion(wc);
+      RDMA_ASSERT(ret == SUCC) << "poll ring write completion error: " << ret;
+    }
+    flags |= (qp->high_watermark_ == qp->low_watermark_) ? IBV_SEND_SIGNALED : 0;
+    qp->high_watermark_ += 1;
+
+    auto ret = qp->post_send_to_mr(local_mr_,p.remote_mr,IBV_WR_RDMA_WRITE,local_buf,len,remote_off,flags);
+    RDMA_ASSERT(ret == SUCC) << "post ring write error: " << strerror(errno);
+  }
+};
+
+} // namespace rdmaio
@@ -1,9 +1,13 @@
 #pragma once
 
 #include <infiniband/verbs.h>
+#include <fcntl.h>
+#include <mutex>
+#include <set>
 #include <vector>
 
 #include "logging.hpp"
+#include "ah_cache.hpp"
 
 namespace rdmaio {
 
@@ -139,6 +143,34 @@ struct RNicHandler {
       lid(lid),
       gid(gid)
   {
+    // async events are drained by polling, see qp_failed
+    int flags = fcntl(ctx->async_fd,F_GETFL);
+    RDMA_VERIFY(WARNING,fcntl(ctx->async_fd,F_SETFL,flags | O_NONBLOCK) == 0)
+        << "failed to set async event fd non-blocking at device " << dev_id;
+  }
+
+  /**
+   * Drain the async events of the device without blocking.
+   * return true if a fatal event has been reported for the QP (qpn); the report is consumed.
+   */
+  bool qp_failed(uint32_t qpn) {
+    std::lock_guard<std::mutex> guard(async_lock_);
+
+    struct ibv_async_event event;
+    while(ibv_get_async_event(ctx,&event) == 0) {
+      switch(event.event_type) {
+        case IBV_EVENT_QP_FATAL:
+        case IBV_EVENT_QP_REQ_ERR:
+        case IBV_EVENT_QP_ACCESS_ERR:
+        case IBV_EVENT_PATH_MIG_ERR:
+          failed_qps_.insert(event.element.qp->qp_num);
+          break;
+        default:
+          RDMA_LOG(4) << "async event at device " << dev_id << ": " << ibv_event_type_str(event.event_type);
+      }
+      ibv_ack_async_event(&event);
+    }
+    return failed_qps_.erase(qpn) > 0;
   }
 
   address_t query_addr() {
@@ -162,6 +194,7 @@ struct RNicHandler {
   friend class RdmaCtrl;
   ~RNicHandler() {
     // delete ctx & pd
+    ah_cache.clear();
     RDMA_VERIFY(INFO,ibv_close_device(ctx) == 0) << "failed to close device " << dev_id;
     RDMA_VERIFY(INFO,ibv_dealloc_pd(pd) == 0)    << "failed to dealloc pd at device " << dev_id
                                                      << "; w error " << strerror(errno);
@@ -175,6 +208,14 @@ struct RNicHandler {
   struct ibv_pd      *pd;
   uint16_t lid;
   uint16_t gid;
+
+  // address handlers, and the peers' addresses & QPNs, shared by the UD QPs of the device
+  AHCache     ah_cache;
+  UDPeerTable ud_peers;
+
+ private:
+  std::mutex         async_lock_;
+  std::set<uint32_t> failed_qps_;
 };
 
 
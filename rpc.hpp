@@ -0,0 +1,247 @@
+#pragma once
+
+#include <functional>
+#include <algorithm>
+#include <vector>
+
+#include "ud_adapter.hpp"
+
+/**
+ * An RPC layer in the style of FaSST, on top of a MsgAdapter (usually UDAdapter).
+ * - The sender's node & thread id are carried in the immediate by the adapter, and an 8-byte Header
+ *   (RPC type, request / reply, length & request id) is written to the header_len() bytes reserved
+ *   before the payload, so neither requests nor replies are copied by the RPC layer.
+ * - Handlers are registered by the RPC type, and write the reply to a buffer of the RPC layer; the replies
+ *   of the requests received in one poll are sent in a batch, since the adapter (UDAdapter) pends them
+ *   during poll_comps.
+ * - A call returns a Future; the reply is copied to the buffer given by the call. The calls to each server
+ *   are pipelined, with at most window outstanding ones; a call beyond it polls until one completes.
+ * - The round trip of each call is fed to the adapter (rtt_sample), which drives its congestion control.
+ * - A handler may call, but not wait: the handlers run inside the adapter's poll, which is not re-entered,
+ *   so a call in a handler returns NOT_READY if the window (or the slots) is full.
+ * - UD may lose a request or its reply; over UDAdapter, wait with a timeout, or use a reliable adapter
+ *   (ReliableAdapter) if the calls shall not be lost.
+ * One per thread, like the adapters.
+ */
+namespace rdmaio {
+
+// return the length of the reply written to reply, or -1 if there is no reply
+typedef std::function<int(const char *req,int len,char *reply,int node_id,int tid)> rpc_handler_t;
+
+class RPC {
+ public:
+  static const int MAX_TYPES       = 256;
+  static const int MAX_OUTSTANDING = 256;
+  static const int DEFAULT_WINDOW  = 16;
+  static const uint64_t NO_TIMEOUT = 0;
+
+  struct Header {
+    uint32_t type  : 8;
+    uint32_t reply : 1;
+    uint32_t len   : 23;
+    uint32_t req_id;
+  };
+
+  struct Future {
+    uint32_t req_id;
+  };
+
+  RPC(MsgAdapter *adapter,int max_reply_size = UDAdapter::MAX_MSG_SIZE - sizeof(Header),
+      int window = DEFAULT_WINDOW):
+      adapter_(adapter),
+      max_reply_size_(max_reply_size),
+      window_(window),
+      handlers_(MAX_TYPES),
+      slots_(MAX_OUTSTANDING)
+  {
+    RDMA_ASSERT(max_reply_size < (1 << 23));
+    adapter_->set_callback([this](const char *msg,int node_id,int tid) {
+        this->on_msg(msg,node_id,tid);
+      });
+
+    for(int i = MAX_OUTSTANDING - 1;i >= 0;--i)
+      free_slots_.push_back(i);
+
+    // replies are sent from the ring, in the registered heap
+    reply_ring_ = (char *)Rmalloc((uint64_t)REPLY_RING * reply_slot_size());
+    RDMA_ASSERT(reply_ring_ != nullptr) << "failed to allocate reply buffers.";
+  }
+
+  ~RPC() {
+    Rfree(reply_ring_);
+  }
+
+  void register_handler(int type,rpc_handler_t handler) {
+    RDMA_ASSERT(type >= 0 && type < MAX_TYPES);
+    handlers_[type] = handler;
+  }
+
+  /**
+   * The bytes to reserve before a request, including the ones used by the adapter
+   */
+  inline int header_len() const {
+    return sizeof(Header) + adapter_->msg_meta_len();
+  }
+
+  /**
+   * Call the RPC of type at the node; req must be preceded by header_len() reserved bytes.
+   * The reply (at most reply_cap bytes) is copied to reply_buf once it arrives.
+   * return NOT_READY if it is called in a handler, and the window to the node (or the slots) is full.
+   */
+  ConnStatus call(int node_id,int type,char *req,int len,char *reply_buf,int reply_cap,Future &f) {
+
+    if((size_t)node_id >= outstanding_.size())
+      outstanding_.resize(node_id + 1,0);
+    while(outstanding_[node_id] >= window_ || free_slots_.empty()) {
+      if(in_poll_)
+        return NOT_READY;
+      poll_adapter();
+    }
+
+    int idx = free_slots_.back();
+    free_slots_.pop_back();
+    Slot &s = slots_[idx];
+    s.gen      += 1;
+    s.node_id   = node_id;
+    s.reply_buf = reply_buf;
+    s.reply_cap = reply_cap;
+    s.done      = false;
+    s.send_ns   = PathMonitor::now_ns();
+    f.req_id = (s.gen << 8) | idx;
+
+    Header *h = (Header *)(req - sizeof(Header));
+    *h = { .type = (uint32_t)type,.reply = 0,.len = (uint32_t)len,.req_id = f.req_id };
+
+    outstanding_[node_id] += 1;
+    // pended and flushed, so that it can be called in a handler, while the replies are pending
+    auto ret = adapter_->send_pending(node_id,(char *)h,len + sizeof(Header));
+    if(ret == SUCC)
+      ret = adapter_->flush_pending();
+    if(ret != SUCC) {
+      outstanding_[node_id] -= 1;
+      free_slots_.push_back(idx);
+    }
+    return ret;
+  }
+
+  /**
+   * Whether the reply of the call has arrived, so wait returns at once.
+   * return false for a future which has been waited, whose slot may be reused by another call.
+   */
+  inline bool ready(const Future &f) const {
+    const Slot &s = slots_[f.req_id & 0xff];
+    return ((s.gen << 8) | (f.req_id & 0xff)) == f.req_id && s.done;
+  }
+
+  /**
+   * Poll until the reply of the call arrives, or timeout_ns passes (if it is not NO_TIMEOUT).
+   * return the length of the reply, which is truncated if it is larger than reply_cap;
+   * or -1 on timeout, after which the call is abandoned, and its late reply is dropped.
+   */
+  int wait(Future &f,uint64_t timeout_ns = NO_TIMEOUT) {
+    RDMA_ASSERT(!in_poll_) << "wait in an RPC handler";
+    Slot &s = slots_[f.req_id & 0xff];
+    RDMA_ASSERT(((s.gen << 8) | (f.req_id & 0xff)) == f.req_id) << "the future has been waited";
+
+    uint64_t start = (timeout_ns == NO_TIMEOUT) ? 0 : PathMonitor::now_ns();
+    while(!s.done) {
+      poll_adapter();
+      if(!s.done && timeout_ns != NO_TIMEOUT && PathMonitor::now_ns() - start >= timeout_ns) {
+        outstanding_[s.node_id] -= 1;
+        s.reply_len = -1;
+        break;
+      }
+    }
+    free_slots_.push_back(f.req_id & 0xff);
+    s.gen += 1;  // the future is consumed, so a late reply mismatches
+    s.done = true;
+    return s.reply_len;
+  }
+
+  /**
+   * Receive requests & replies; handlers are called in it.
+   * It returns at once in a handler.
+   */
+  inline void poll() {
+    if(!in_poll_)
+      poll_adapter();
+  }
+
+ private:
+  // a reply buffer is reused after the UD send queue wraps twice, so its send has completed
+  static const int REPLY_RING = 2 * UDQPImpl::MAX_SEND_SIZE;
+
+  struct Slot {
+    uint32_t gen = 0;
+    int   node_id;
+    char *reply_buf;
+    int   reply_cap;
+    int   reply_len;
+    uint64_t send_ns;
+    bool  done = true;
+  };
+
+  MsgAdapter *adapter_;
+  const int max_reply_size_;
+  const int window_;
+  bool in_poll_ = false;  // whether the handlers (or replies) are being processed
+
+  std::vector<rpc_handler_t> handlers_;
+
+  // client side
+  std::vector<Slot> slots_;
+  std::vector<int>  free_slots_;
+  std::vector<int>  outstanding_;  // calls waiting for replies, per server
+
+  // server side
+  char    *reply_ring_ = nullptr;
+  uint64_t reply_seq_  = 0;
+
+  inline void poll_adapter() {
+    in_poll_ = true;
+    adapter_->poll_comps();
+    in_poll_ = false;
+  }
+
+  inline uint64_t reply_slot_size() const {
+    return header_len() + max_reply_size_;
+  }
+
+  void on_msg(const char *msg,int node_id,int tid) {
+
+    const Header *h = (const Header *)msg;
+    if(h->reply) {
+      Slot &s = slots_[h->req_id & 0xff];
+      if(s.done || ((s.gen << 8) | (h->req_id & 0xff)) != h->req_id || s.node_id != node_id) {
+        RDMA_LOG(WARNING) << "unexpected reply " << h->req_id << " from " << node_id;
+        return;
+      }
+      s.reply_len = h->len;
+      memcpy(s.reply_buf,msg + sizeof(Header),std::min((int)h->len,s.reply_cap));
+      s.done = true;
+      outstanding_[node_id] -= 1;
+      // it includes the server's handling, which is small for the RPCs this layer targets
+      adapter_->rtt_sample(node_id,PathMonitor::now_ns() - s.send_ns);
+      return;
+    }
+
+    auto &handler = handlers_[h->type];
+    if(!handler) {
+      RDMA_LOG(WARNING) << "no handler for RPC type " << h->type << " from " << node_id;
+      return;
+    }
+    char *slot  = reply_ring_ + (reply_seq_++ % REPLY_RING) * reply_slot_size();
+    char *reply = slot + header_len();
+    int len = handler(msg + sizeof(Header),h->len,reply,node_id,tid);
+    if(len < 0)
+      return;
+    RDMA_ASSERT(len <= max_reply_size_) << "reply of " << len << " bytes exceeds max_reply_size";
+
+    Header *rh = (Header *)(reply - sizeof(Header));
+    *rh = { .type = h->type,.reply = 1,.len = (uint32_t)len,.req_id = h->req_id };
+    auto ret = adapter_->send_pending(node_id,(char *)rh,len + sizeof(Header));
+    RDMA_VERIFY(WARNING,ret == SUCC) << "send reply to " << node_id << " error: " << ret;
+  }
+};
+
+} // namespace rdmaio
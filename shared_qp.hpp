@@ -0,0 +1,330 @@
+#pragma once
+
+#include <atomic>
+#include <limits>
+#include <mutex>
+#include <vector>
+#include <infiniband/verbs.h>
+
+#include "common.hpp"
+#include "qp_impl.hpp"
+
+namespace rdmaio {
+
+/**
+ * A QP shared by a group of threads, so that the number of QPs to a node does not grow
+ * with the number of workers.
+ *
+ * It uses flat combining: a thread publishes its request in its own slot, and whoever grabs
+ * the combiner lock posts the pending requests of all slots as one linked list (one doorbell).
+ * Completions are polled by the combiner, and routed back to the slot of the submitting thread
+ * through the wr_id.
+ *
+ * Each thread uses the slot (worker_id % max_threads). Requests are posted to the local & remote MR
+ * bound to the underlying QP; write combining and staging of the QP are not used.
+ */
+template <class QPType>
+class RSharedQP {
+ public:
+  // the QP index reserved for shared QPs
+  static const int QP_IDX = 61;
+  // an unsignaled request is signaled internally every SIGNAL_INTERVAL requests
+  static const int SIGNAL_INTERVAL = RCQPImpl::RC_MAX_SEND_SIZE / 4;
+  static const int MAX_POLL_SIZE   = 16;
+
+  RSharedQP(QPType *qp,int max_threads):
+      qp_(qp),
+      max_threads_(max_threads),
+      slots_(max_threads),
+      inflight_(RCQPImpl::RC_MAX_SEND_SIZE)
+  {
+    for(auto &s : slots_)
+      s.wcs.resize(RCQPImpl::RC_MAX_SEND_SIZE);
+  }
+
+  inline QPType *qp() const {
+    return qp_;
+  }
+
+  inline int max_threads() const {
+    return max_threads_;
+  }
+
+  /**
+   * Connect the underlying QP; it is fine for all threads of the group to call it.
+   */
+  ConnStatus connect(std::string ip,int port) {
+    std::lock_guard<std::mutex> guard(connect_lock_);
+    return qp_->connect(ip,port);
+  }
+
+  /**
+   * Post a request of the thread (tid), which returns once the request has been posted.
+   * The completion is returned by poll_send_completion/poll_till_completion of the same thread
+   * only if the request is signaled.
+   * return NOT_READY if the thread has too many completions not polled.
+   */
+  ConnStatus post_send(int tid,ibv_wr_opcode op,char *local_buf,uint32_t len,uint64_t off,int flags,
+                       uint64_t wr_id = 0, uint32_t imm = 0) {
+
+    Slot &s = slots_[tid % max_threads_];
+    s.op        = op;
+    s.local_buf = local_buf;
+    s.len       = len;
+    s.off       = off;
+    s.flags     = flags;
+    s.wr_id     = wr_id;
+    s.imm       = imm;
+    s.state.store(PENDING,std::memory_order_release);
+
+    while(s.state.load(std::memory_order_acquire) == PENDING) {
+      if(combiner_lock_.try_lock()) {
+        combine();
+        combiner_lock_.unlock();
+      } else
+        asm volatile("pause" ::: "memory");
+    }
+    s.state.store(EMPTY,std::memory_order_relaxed);
+    return s.result;
+  }
+
+  /**
+   * Poll a completion of the thread (tid)
+   * return 1 if there is one, 0 if there is none, and -1 if polling the CQ fails.
+   */
+  int poll_send_completion(int tid,ibv_wc &wc) {
+
+    Slot &s = slots_[tid % max_threads_];
+    if(pop_completion(s,wc))
+      return 1;
+
+    if(combiner_lock_.try_lock()) {
+      int n = reap_completions();
+      combiner_lock_.unlock();
+      if(n < 0)
+        return n;
+    }
+    return pop_completion(s,wc) ? 1 : 0;
+  }
+
+  ConnStatus poll_till_completion(int tid,ibv_wc &wc,struct timeval timeout = default_timeout) {
+
+    struct timeval start_time; gettimeofday(&start_time,nullptr);
+    int64_t numeric_timeout = (timeout.tv_sec == 0 && timeout.tv_usec == 0) ? std::numeric_limits<int64_t>::max() :
+                              timeout.tv_sec * 1000 + timeout.tv_usec;
+    int poll_result;
+    while((poll_result = poll_send_completion(tid,wc)) == 0) {
+      struct timeval cur_time; gettimeofday(&cur_time,nullptr);
+      if(diff_time(cur_time,start_time) > numeric_timeout)
+        return TIMEOUT;
+    }
+    if(poll_result < 0)
+      return ERR;
+    return wc.status == IBV_WC_SUCCESS ? SUCC : ERR;
+  }
+
+ private:
+  enum {
+    EMPTY = 0,
+    PENDING,
+    DONE
+  };
+
+  struct Slot {
+    std::atomic<int> state;
+
+    // the published request
+    ibv_wr_opcode op;
+    char    *local_buf;
+    uint32_t len;
+    uint64_t off;
+    int      flags;
+    uint64_t wr_id;
+    uint32_t imm;
+    ConnStatus result;
+
+    // completions routed to this thread; written by the combiner, read by the owner
+    std::vector<ibv_wc>   wcs;
+    std::atomic<uint64_t> wc_head;
+    std::atomic<uint64_t> wc_tail;
+    uint64_t reserved;   // completions the combiner has reserved in wcs, only used by the combiner
+
+    char padding[64];    // avoid false sharing between slots
+
+    Slot(): state(EMPTY),wc_head(0),wc_tail(0),reserved(0) {
+    }
+    Slot(const Slot &) = delete;
+  };
+
+  // the posted requests which have not completed, indexed by the sequence (wr_id)
+  struct Inflight {
+    int      slot;
+    uint64_t user_wr_id;
+    bool     user_signaled;
+  };
+
+  QPType *const qp_;
+  const int max_threads_;
+
+  std::vector<Slot> slots_;
+
+  std::mutex connect_lock_;
+  std::mutex combiner_lock_;
+
+  // the states below are only accessed with combiner_lock_ held
+  std::vector<Inflight> inflight_;
+  uint64_t posted_  = 0;   // sequence of the next request
+  uint64_t retired_ = 0;   // requests before it have completed
+  uint64_t last_signaled_ = 0;
+
+  struct ibv_send_wr srs_[RCQPImpl::RC_MAX_SEND_SIZE];
+  struct ibv_sge     sges_[RCQPImpl::RC_MAX_SEND_SIZE];
+  int                batch_slots_[RCQPImpl::RC_MAX_SEND_SIZE];
+
+  inline bool pop_completion(Slot &s,ibv_wc &wc) {
+    uint64_t head = s.wc_head.load(std::memory_order_relaxed);
+    if(head == s.wc_tail.load(std::memory_order_acquire))
+      return false;
+    wc = s.wcs[head % s.wcs.size()];
+    s.wc_head.store(head + 1,std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * Post the published requests of all slots with one doorbell
+   */
+  void combine() {
+
+    int num = 0;
+    bool failed = false;             // the CQ cannot be polled, so the pending requests fail
+    uint64_t signaled = last_signaled_;
+    for(int i = 0;i < max_threads_;++i) {
+
+      Slot &s = slots_[i];
+      if(s.state.load(std::memory_order_acquire) != PENDING)
+        continue;
+
+      bool user_signaled = (s.flags & IBV_SEND_SIGNALED) != 0;
+      if(user_signaled && s.reserved - s.wc_head.load(std::memory_order_acquire) >= s.wcs.size()) {
+        s.result = NOT_READY;
+        s.state.store(DONE,std::memory_order_release);
+        continue;
+      }
+
+      // wait for a free entry of the send queue
+      while(!failed && posted_ + num - retired_ >= RCQPImpl::RC_MAX_SEND_SIZE - 1) {
+        if(num > 0) {
+          post_batch(num);
+          num = 0;
+          signaled = last_signaled_;
+        } else if(reap_completions() < 0) {
+          failed = true;
+        }
+      }
+      if(failed) {
+        s.result = ERR;
+        s.state.store(DONE,std::memory_order_release);
+        continue;
+      }
+
+      uint64_t seq = posted_ + num;
+      int flags = s.flags;
+      if(seq - signaled >= SIGNAL_INTERVAL)
+        flags |= IBV_SEND_SIGNALED;
+      if(flags & IBV_SEND_SIGNALED)
+        signaled = seq;
+      if(user_signaled)
+        s.reserved += 1;
+
+      inflight_[seq % inflight_.size()] = Inflight { .slot = i,.user_wr_id = s.wr_id,.user_signaled = user_signaled };
+
+      sges_[num].addr   = (uint64_t)s.local_buf;
+      sges_[num].length = s.len;
+      sges_[num].lkey   = qp_->local_mr_.key;
+
+      ibv_send_wr &sr = srs_[num];
+      sr.wr_id      = seq;
+      sr.opcode     = s.op;
+      sr.num_sge    = 1;
+      sr.sg_list    = &sges_[num];
+      sr.send_flags = flags;
+      sr.imm_data   = s.imm;
+      sr.wr.rdma.remote_addr = qp_->remote_mr_.buf + s.off;
+      sr.wr.rdma.rkey        = qp_->remote_mr_.key;
+      sr.next       = NULL;
+      if(num > 0)
+        srs_[num - 1].next = &sr;
+
+      batch_slots_[num] = i;
+      num += 1;
+    }
+    if(num > 0)
+      post_batch(num);
+  }
+
+  void post_batch(int num) {
+
+    struct ibv_send_wr *bad_sr = nullptr;
+    int rc = ibv_post_send(qp_->qp_,&srs_[0],&bad_sr);
+
+    // requests before the bad one have been posted
+    int posted = (rc == 0) ? num : (bad_sr - srs_);
+    if(rc != 0)
+      RDMA_LOG(WARNING) << "post shared qp requests error: " << strerror(errno);
+
+    for(int i = 0;i < num;++i) {
+      // only a posted request counts as signaled
+      if(i < posted && (srs_[i].send_flags & IBV_SEND_SIGNALED))
+        last_signaled_ = srs_[i].wr_id;
+      Slot &s = slots_[batch_slots_[i]];
+      if(i >= posted && (s.flags & IBV_SEND_SIGNALED))
+        s.reserved -= 1;
+      s.result = (i < posted) ? SUCC : ERR;
+      s.state.store(DONE,std::memory_order_release);
+    }
+    posted_ += posted;
+  }
+
+  /**
+   * Poll the CQ and route the completions to the submitting threads
+   */
+  int reap_completions() {
+
+    ibv_wc wcs[MAX_POLL_SIZE];
+    int n = ibv_poll_cq(qp_->cq_,MAX_POLL_SIZE,wcs);
+    if(n < 0) {
+      RDMA_LOG(ERROR) << "poll shared qp cq error: " << strerror(errno);
+      return n;
+    }
+
+    for(int i = 0;i < n;++i) {
+      ibv_wc &wc = wcs[i];
+      uint64_t seq = wc.wr_id;
+      Inflight &req = inflight_[seq % inflight_.size()];
+
+      // the RC QP completes requests in order
+      if(seq + 1 > retired_)
+        retired_ = seq + 1;
+
+      if(!req.user_signaled && wc.status == IBV_WC_SUCCESS)
+        continue;
+
+      Slot &s = slots_[req.slot];
+      if(!req.user_signaled) {
+        // errors are always reported, if the thread has room for them
+        if(s.reserved - s.wc_head.load(std::memory_order_acquire) >= s.wcs.size()) {
+          RDMA_LOG(WARNING) << "drop shared qp error completion: " << ibv_wc_status_str(wc.status);
+          continue;
+        }
+        s.reserved += 1;
+      }
+      wc.wr_id = req.user_wr_id;
+      uint64_t tail = s.wc_tail.load(std::memory_order_relaxed);
+      s.wcs[tail % s.wcs.size()] = wc;
+      s.wc_tail.store(tail + 1,std::memory_order_release);
+    }
+    return n;
+  }
+};
+
+} // namespace rdmaio
@@ -0,0 +1,252 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <infiniband/verbs.h>
+
+#include "common.hpp"
+
+namespace rdmaio {
+
+/**
+ * Registered staging buffers of a thread, used to post requests from un-registered memory.
+ * Buffers are carved from large registered slabs, and recycled in power-of-two size classes.
+ */
+class StagingPool {
+ public:
+  static const uint32_t SLAB_SIZE       = 4 * 1024 * 1024;
+  static const uint32_t MIN_CHUNK_SIZE  = 64;
+  static const uint32_t MAX_STAGED_SIZE = 4096; // larger payloads are registered on the fly, instead of copied
+  static const int      MAX_SLABS       = 16;
+
+  /**
+   * Each thread has one pool per RNIC
+   */
+  static StagingPool *thread_local_pool(RNicHandler *rnic) {
+    static thread_local std::map<RNicHandler *,std::unique_ptr<StagingPool> > pools;
+    auto &pool = pools[rnic];
+    if(!pool)
+      pool.reset(new StagingPool(rnic));
+    return pool.get();
+  }
+
+  explicit StagingPool(RNicHandler *rnic):
+      rnic_(rnic)
+  {
+  }
+
+  ~StagingPool() {
+    for(auto &s : slabs_) {
+      char *buf = (char *)(s.mr->addr);
+      delete s.mr;
+      free(buf);
+    }
+  }
+
+  /**
+   * return nullptr if all slabs are used
+   */
+  char *alloc(uint32_t len,uint32_t &lkey) {
+
+    int c = size_class(len);
+    if(!free_chunks_[c].empty()) {
+      auto chunk = free_chunks_[c].back();
+      free_chunks_[c].pop_back();
+      lkey = chunk.lkey;
+      return chunk.buf;
+    }
+
+    uint32_t size = MIN_CHUNK_SIZE << c;
+    if(slabs_.empty() || slabs_.back().used + size > SLAB_SIZE) {
+      if(slabs_.size() >= MAX_SLABS || !add_slab())
+        return nullptr;
+    }
+    Slab &s = slabs_.back();
+    char *res = (char *)(s.mr->addr) + s.used;
+    s.used += size;
+    lkey = s.mr->mr->lkey;
+    return res;
+  }
+
+  void dealloc(char *buf,uint32_t len,uint32_t lkey) {
+    free_chunks_[size_class(len)].push_back(Chunk { .buf = buf,.lkey = lkey });
+  }
+
+  inline RNicHandler *rnic() const {
+    return rnic_;
+  }
+
+ private:
+  static const int NUM_CLASSES = 7; // 64B - 4KB
+
+  struct Slab {
+    Memory  *mr;
+    uint32_t used;
+  };
+
+  struct Chunk {
+    char    *buf;
+    uint32_t lkey;
+  };
+
+  RNicHandler *rnic_;
+  std::vector<Slab>  slabs_;
+  std::vector<Chunk> free_chunks_[NUM_CLASSES];
+
+  static inline int size_class(uint32_t len) {
+    int c = 0;
+    while((MIN_CHUNK_SIZE << c) < len)
+      c += 1;
+    return c;
+  }
+
+  bool add_slab() {
+    char *buf = (char *)malloc(SLAB_SIZE);
+    if(buf == nullptr)
+      return false;
+    Memory *m = new Memory(buf,SLAB_SIZE,rnic_->pd,IBV_ACCESS_LOCAL_WRITE);
+    if(!m->valid()) {
+      delete m;
+      free(buf);
+      return false;
+    }
+    slabs_.push_back(Slab { .mr = m,.used = 0 });
+    return true;
+  }
+};
+
+/**
+ * Track the staged buffers of one QP until their requests complete.
+ * A staged request is always signaled with an internal wr_id. Its completion releases the buffer
+ * (and copies the read data back), and is passed to the user only if the user asked for a signal.
+ * The pool belongs to the thread creating it, which is not thread-safe, so the requests shall be staged
+ * and completed by that thread only; it is asserted.
+ */
+class StagedRequests {
+ public:
+  static const uint64_t WR_ID_BASE = 0x57a9000000000000ULL;
+  static const uint64_t WR_ID_MASK = 0xffff;
+
+  StagedRequests(StagingPool *pool,int max_slots):
+      pool_(pool),
+      owner_(std::this_thread::get_id()),
+      slots_(max_slots)
+  {
+    for(int i = max_slots - 1;i >= 0;--i)
+      free_slots_.push_back(i);
+  }
+
+  // number of staged requests which have not completed
+  inline int inflight() const {
+    return slots_.size() - free_slots_.size();
+  }
+
+  /**
+   * Find a registered buffer for the request.
+   * Small payloads are copied to the staging pool, while large ones are registered in place.
+   * return NOT_READY if no staging buffer is currently available, ERR if the registration fails.
+   */
+  ConnStatus stage(ibv_wr_opcode op,char *buf,uint32_t len,int flags,uint64_t wr_id,
+                   char *&local_buf,uint32_t &lkey,uint64_t &staged_wr_id) {
+
+    RDMA_ASSERT(std::this_thread::get_id() == owner_) << "staging from another thread";
+    if(free_slots_.empty())
+      return NOT_READY;
+
+    Slot s = {};
+    s.user_wr_id    = wr_id;
+    s.user_signaled = (flags & IBV_SEND_SIGNALED) != 0;
+    s.user_buf      = buf;
+    s.len           = len;
+    s.copy_back     = (op == IBV_WR_RDMA_READ);
+
+    if(len <= StagingPool::MAX_STAGED_SIZE) {
+      s.staged = pool_->alloc(len,s.lkey);
+      if(s.staged == nullptr)
+        return NOT_READY;
+      if(!s.copy_back)
+        memcpy(s.staged,buf,len);
+      local_buf = s.staged;
+    } else {
+      s.mr = new Memory(buf,len,pool_->rnic()->pd,IBV_ACCESS_LOCAL_WRITE);
+      if(!s.mr->valid()) {
+        delete s.mr;
+        return ERR;
+      }
+      s.lkey    = s.mr->mr->lkey;
+      s.copy_back = false;
+      local_buf = buf;
+    }
+
+    int idx = free_slots_.back();
+    free_slots_.pop_back();
+    slots_[idx] = s;
+
+    lkey = s.lkey;
+    staged_wr_id = WR_ID_BASE | idx;
+    return SUCC;
+  }
+
+  /**
+   * Release the buffer of a request which failed to post
+   */
+  void cancel(uint64_t staged_wr_id) {
+    release(staged_wr_id & WR_ID_MASK);
+  }
+
+  /**
+   * Handle a completion polled from the QP's CQ.
+   * return true if the completion is internal, and shall not be passed to the user.
+   * Otherwise the wr_id is restored to the user's one.
+   */
+  bool on_completion(ibv_wc &wc) {
+
+    if((wc.wr_id & ~WR_ID_MASK) != WR_ID_BASE)
+      return false;
+
+    RDMA_ASSERT(std::this_thread::get_id() == owner_) << "staged request polled by another thread";
+    int idx = wc.wr_id & WR_ID_MASK;
+    Slot &s = slots_[idx];
+    if(s.copy_back && wc.status == IBV_WC_SUCCESS)
+      memcpy(s.user_buf,s.staged,s.len);
+
+    bool user_signaled = s.user_signaled;
+    wc.wr_id = s.user_wr_id;
+    release(idx);
+
+    // errors are always reported
+    return !user_signaled && wc.status == IBV_WC_SUCCESS;
+  }
+
+ private:
+  struct Slot {
+    uint64_t user_wr_id;
+    bool     user_signaled;
+    char    *user_buf;
+    uint32_t len;
+    bool     copy_back;  // for reads, the data shall be copied to the user buffer
+
+    char    *staged;     // buffer from the staging pool, or
+    Memory  *mr;         // the on-the-fly registration of the user buffer
+    uint32_t lkey;
+  };
+
+  StagingPool *pool_;
+  const std::thread::id owner_;  // the thread of pool_
+  std::vector<Slot> slots_;
+  std::vector<int>  free_slots_;
+
+  void release(int idx) {
+    Slot &s = slots_[idx];
+    if(s.mr != nullptr)
+      delete s.mr;
+    else if(s.staged != nullptr)
+      pool_->dealloc(s.staged,s.len,s.lkey);
+    s = Slot();
+    free_slots_.push_back(idx);
+  }
+};
+
+} // namespace rdmaio
@@ -1,7 +1,19 @@
 #pragma once
 
+#include <deque>
+#include <unordered_map>
+#include <set>
+#include <algorithm>
+#include <vector>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <sys/mman.h>
+
 #include "msg_interface.hpp"
 #include "rdma_ctrl.hpp"
+#include "congestion.hpp"
 #include "ralloc/ralloc.h"
 
 /**
@@ -9,10 +21,18 @@
  */
 namespace rdmaio {
 
+/**
+ * The receive buffers are carved from one contiguous slab, each at a 4KB stride, instead of one allocation
+ * per buffer, so they are dense in the TLB and their addresses are computed from the index.
+ * The slab is from the registered heap; with huge_page, it is mapped with 2MB pages and registered
+ * at the RNIC by itself (falling back to the heap if no huge page is available).
+ * Like the buffers, the slab lives as long as the QP, which is kept by RdmaCtrl.
+ */
 class UDRecvManager {
  public:
-  UDRecvManager(UDQP *qp,int max_recv_num,MemoryAttr local_mr):
-      qp_(qp),max_recv_num_(max_recv_num)
+  UDRecvManager(UDQP *qp,int max_recv_num,MemoryAttr local_mr,
+                RNicHandler *rnic = nullptr,bool huge_page = false):
+      qp_(qp),max_recv_num_(max_recv_num),max_idle_recv_num_(max_recv_num / 4)
   {
     RDMA_ASSERT(max_recv_num_ <= UDQPImpl::MAX_RECV_SIZE)
         << "UD can register at most " << UDQPImpl::MAX_RECV_SIZE << "buffers.";
@@ -27,14 +47,37 @@ class UDRecvManager {
     int recv_buf_size = MAX_PACKET_SIZE;
     RDMA_ASSERT(recv_buf_size <= MAX_PACKET_SIZE);
 
+    uint32_t lkey = local_mr.key;
+    uint64_t slab_size = (uint64_t)max_recv_num_ * RECV_BUF_STRIDE;
+    if(huge_page) {
+      RDMA_ASSERT(rnic != nullptr) << "the huge page slab is registered at the rnic.";
+      slab_size = (slab_size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+      void *addr = mmap(nullptr,slab_size,PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,-1,0);
+      if(addr != MAP_FAILED) {
+        slab_mr_.reset(new Memory((const char *)addr,slab_size,rnic->pd,IBV_ACCESS_LOCAL_WRITE));
+        RDMA_ASSERT(slab_mr_->valid()) << "failed to register the recv slab.";
+        slab_ = (char *)addr;
+        lkey  = slab_mr_->mr->lkey;
+      } else {
+        RDMA_LOG(WARNING) << "no huge page for the recv slab: " << strerror(errno) << "; use the heap instead";
+        slab_size = (uint64_t)max_recv_num_ * RECV_BUF_STRIDE;
+      }
+    }
+    if(slab_ == nullptr)
+      slab_ = (char *)Rmalloc(slab_size);
+    RDMA_ASSERT(slab_ != nullptr) << "failed to allocate recv buffers.";
+    slab_size_ = slab_size;
+    slab_lkey_ = lkey;
+    heap_lkey_ = local_mr.key;
+
     // init receive related structures
     for(uint i = 0;i < max_recv_num_;++i) {
       struct ibv_sge sge {
-        .addr   = (uintptr_t)(Rmalloc(recv_buf_size)),
+        .addr   = (uintptr_t)(slab_ + (uint64_t)i * RECV_BUF_STRIDE),
         .length = (uint32_t)recv_buf_size,
-        .lkey   = local_mr.key
+        .lkey   = lkey
       };
-      RDMA_ASSERT(sge.addr != 0) << "failed to allocate recv buffer.";
       sges_[i] = sge;
 
       rrs_[i].wr_id  = sges_[i].addr;
@@ -53,21 +96,64 @@ class UDRecvManager {
   // the size of global routing header
   static const int GRH_SIZE = 40;
   static const int MAX_PACKET_SIZE = 4096 - GRH_SIZE;
+  static const int RECV_BUF_STRIDE = 4096;
+  static const uint64_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
 
  protected:
 
   UDQP *qp_ = nullptr;
 
+  char *slab_ = nullptr;
+  uint64_t slab_size_ = 0;
+  uint32_t slab_lkey_ = 0;
+  uint32_t heap_lkey_ = 0;
+  std::unique_ptr<Memory> slab_mr_;  // only for the huge page slab
+
   int recv_head_ = 0;
+  int recv_tail_ = 0;  // the slot of the next completion, since the receives complete in the posted order
   int idle_recv_num_ = 0;
-  int max_idle_recv_num_ = 1;
   int max_recv_num_ = 0;
+  // the re-post batch adapts to the completions per poll, up to max_idle_recv_num_
+  int max_idle_recv_num_;
+  int recv_batch_x8_ = 8;  // EWMA (1/8) of the completions per non-empty poll, scaled by 8
 
   struct ibv_recv_wr rrs_[UDQPImpl::MAX_RECV_SIZE];
   struct ibv_sge sges_[UDQPImpl::MAX_RECV_SIZE];
   struct ibv_wc wcs_[UDQPImpl::MAX_RECV_SIZE];
   struct ibv_recv_wr *bad_rr_;
 
+  inline bool in_slab(const char *buf) const {
+    return buf >= slab_ && buf < slab_ + slab_size_;
+  }
+
+  /**
+   * Replace the buffer of a consumed slot, which has not been re-posted, e.g., its buffer is held
+   * by the application. buf is either in the slab, or a MAX_PACKET_SIZE one from the registered heap.
+   */
+  inline void replace_recv_buf(int slot,char *buf) {
+    sges_[slot].addr = (uintptr_t)buf;
+    sges_[slot].lkey = in_slab(buf) ? slab_lkey_ : heap_lkey_;
+    rrs_[slot].wr_id = sges_[slot].addr;
+  }
+
+  /**
+   * Account the buffers consumed by a poll, and re-post them once there are more than a batch.
+   * A burst of completions raises the batch, so fewer (and larger) posts are used under load,
+   * while a light load re-posts the buffers almost at once.
+   * return true if the buffers are re-posted.
+   */
+  inline bool replenish_recvs(int completed) {
+    if(completed == 0)
+      return false;
+    idle_recv_num_ += completed;
+    recv_batch_x8_ += completed - (recv_batch_x8_ >> 3);
+    if(idle_recv_num_ <= std::min(recv_batch_x8_ >> 3,max_idle_recv_num_))
+      return false;
+    post_recvs(idle_recv_num_);
+    idle_recv_num_ = 0;
+    return true;
+  }
+
   void post_recvs(int recv_num) {
 
     if(recv_num <= 0) {
@@ -94,16 +180,146 @@ class UDRecvManager {
   // class specific constants
 };
 
+class UDAdapter;
+
+/**
+ * A reference-counted handle of a received message, which owns its receive buffer (see UDAdapter::hold).
+ * The count is kept in the GRH bytes of the buffer, which are not used once received, so copying or
+ * releasing a handle allocates nothing. It can be copied to, and released at, any thread.
+ */
+class RecvHandle {
+ public:
+  RecvHandle() {
+  }
+
+  RecvHandle(const RecvHandle &o) : buf_(o.buf_) {
+    if(buf_ != nullptr)
+      meta()->refs.fetch_add(1,std::memory_order_relaxed);
+  }
+
+  RecvHandle(RecvHandle &&o) : buf_(o.buf_) {
+    o.buf_ = nullptr;
+  }
+
+  RecvHandle &operator=(RecvHandle o) {
+    std::swap(buf_,o.buf_);
+    return *this;
+  }
+
+  ~RecvHandle() {
+    reset();
+  }
+
+  inline bool valid() const {
+    return buf_ != nullptr;
+  }
+
+  inline const char *data() const {
+    return buf_ + GRH_SIZE;
+  }
+
+  inline int len() const {
+    return meta()->len;
+  }
+
+  // release the reference; the buffer is returned to its adapter with the last one
+  inline void reset();
+
+ private:
+  friend class UDAdapter;
+  static const int GRH_SIZE = 40;
+
+  struct Meta {
+    std::atomic<int> refs;
+    int        len;
+    UDAdapter *owner;
+  };
+  static_assert(sizeof(Meta) <= GRH_SIZE,"the handle meta must fit in the GRH");
+
+  char *buf_ = nullptr;  // the start of the receive buffer
+
+  inline Meta *meta() const {
+    return (Meta *)buf_;
+  }
+};
+
+/**
+ * Messaging over one UD QP per worker.
+ *
+ * Sending:
+ * - a message fitting in one receive buffer (MAX_MSG_SIZE) is one packet;
+ * - a larger one (up to MAX_FRAG_MSG_SIZE) is split into packets with a FragHeader each, which the receiver
+ *   reassembles in any order. Partial messages are dropped after REASSEMBLY_TIMEOUT_US, and their memory
+ *   is capped (set_reassembly_cap);
+ * - the packet kind and the returned credits are carried in the immediate, next to the thread id.
+ *
+ * Completions: every SIGNAL_INTERVAL-th WR is signaled and reaped by poll_comps, so a send blocks
+ * only if the send queue is full. A tracked send (send_to_tracked, send_owned) is signaled, and notified
+ * (or its buffer freed) once it completes.
+ *
+ * Rendezvous (enable_rendezvous): a message above the eager threshold is sent as a descriptor, and the
+ * receiver reads the payload with an RC RDMA read; the echoed descriptor tells the sender its buffer is free.
+ *
+ * Flow control (enable_flow_control): the sender holds credits, i.e., the receive buffers reserved for it.
+ * A packet without credit is queued (copied) at the sender; credits return piggybacked or in a credit update.
+ *
+ * Congestion control (enable_congestion_control): packets to a peer are paced by a RateController fed
+ * with rtt_sample from the layer above; packets over the rate are queued, and posted by poll_comps.
+ *
+ * Batch callback (set_batch_callback): the messages of a poll are delivered in one call.
+ *
+ * Multicast (join_group, add_group_member): a broadcast to the group is one multicast packet.
+ *
+ * Holding (hold): a callback may keep its message instead of copying it; the receive slot gets a spare
+ * buffer, and the spare pool is trimmed to MAX_SPARE_BUFS as held messages are released.
+ */
 class UDAdapter : public MsgAdapter, public UDRecvManager {
   static const int MAX_UD_SEND_DOORBELL = 16;
  public:
+  // the largest message in one packet, since the receive buffer also holds the GRH
+  static const int MAX_MSG_SIZE            = MAX_PACKET_SIZE - GRH_SIZE;
+  static const int MAX_FRAG_MSG_SIZE       = 1024 * 1024;
+  static const int DEFAULT_REASSEMBLY_CAP  = 64 * 1024 * 1024;
+  static const int REASSEMBLY_TIMEOUT_US   = 100000;
+  static const int DEFAULT_EAGER_THRESHOLD = MAX_MSG_SIZE;
+  static const int DEFAULT_MAX_RNDV_SIZE   = 16 * 1024 * 1024;
+  // the QP index reserved for the RC QPs reading rendezvous payloads
+  static const int RNDV_QP_IDX = 60;
+
+  struct RndvDesc {
+    uint64_t addr;
+    uint32_t rkey;
+    uint32_t len;
+  };
+
+  // a message delivered to the batch callback
+  struct RecvMsg {
+    const char *msg;
+    int len;
+    int node_id;
+    int tid;
+  };
+
+  struct FragHeader {
+    uint32_t msg_id;
+    uint32_t total_len;
+    uint32_t offset;
+    uint32_t reserved;
+  };
+  static const int FRAG_PAYLOAD = MAX_MSG_SIZE - sizeof(FragHeader);
+
   UDAdapter(std::shared_ptr<RdmaCtrl> cm, RNicHandler *rnic, MemoryAttr local_mr,
-        int w_id, int max_recv_num):
+        int w_id, int max_recv_num,bool huge_page_recv = false):
+      UDRecvManager(cm->create_ud_qp(create_ud_idx(w_id,RECV_QP_IDX),rnic,&local_mr),max_recv_num,local_mr,
+                    rnic,huge_page_recv),
       node_id_(cm->current_node_id()),
       worker_id_(w_id),
-      UDRecvManager(cm->create_ud_qp(create_ud_idx(w_id,RECV_QP_IDX),rnic,&local_mr),max_recv_num,local_mr),
-      send_qp_(cm->create_ud_qp(create_ud_idx(w_id,SEND_QP_IDX),rnic,&local_mr))
+      send_qp_(cm->create_ud_qp(create_ud_idx(w_id,SEND_QP_IDX),rnic,&local_mr)),
+      cm_(cm),
+      rnic_(rnic),
+      local_mr_(local_mr)
   {
+    RDMA_ASSERT(worker_id_ < (1 << CREDIT_SHIFT)) << "worker id " << worker_id_ << " overlaps the packet kind.";
     // init send structures
     for(uint i = 0;i < MAX_UD_SEND_DOORBELL;++i) {
       srs_[i].opcode = IBV_WR_SEND_WITH_IMM;
@@ -115,68 +331,328 @@ class UDAdapter : public MsgAdapter, public UDRecvManager {
 
       ssges_[i].lkey = local_mr.key;
     }
+    // in the registered heap, since fragments are too large to be inlined
+    frag_hdrs_ = (FragHeader *)Rmalloc(sizeof(FragHeader) * MAX_FRAG_HEADERS);
+    RDMA_ASSERT(frag_hdrs_ != nullptr) << "failed to allocate fragment headers.";
   }
 
-  ConnStatus connect(std::string ip,int port) {
-    return send_qp_->connect(ip,port,create_ud_idx(worker_id_,RECV_QP_IDX));
+  /**
+   * Opt-in rendezvous for messages larger than eager_threshold.
+   * Such a message must be inside the local MR, and must not be modified until it is released,
+   * see set_release_callback.
+   * Both sides shall enable it before connecting to each other; the rendezvous QPs are connected by connect().
+   */
+  void enable_rendezvous(int eager_threshold = DEFAULT_EAGER_THRESHOLD,
+                         int max_rndv_size   = DEFAULT_MAX_RNDV_SIZE) {
+    RDMA_ASSERT(eager_threshold <= MAX_FRAG_MSG_SIZE);
+    eager_threshold_ = eager_threshold;
+    max_rndv_size_   = max_rndv_size;
+    rndv_enabled_    = true;
   }
 
-  ConnStatus send_to(int node_id,const char *msg,int len) {
+  /**
+   * Opt-in credit-based flow control; each of the max_senders remote adapters gets 3/4 of the receive buffers
+   * divided evenly as credits, and the rest absorbs the credit updates.
+   * Both sides shall enable it with the same max_recv_num & max_senders, before sending.
+   */
+  void enable_flow_control(int max_senders) {
+    credits_per_sender_ = std::max(1,max_recv_num_ * 3 / 4 / max_senders);
+    credit_batch_       = std::max(1,credits_per_sender_ / 2);
+    // credits are returned once the buffers are re-posted, so re-post them at every poll
+    max_idle_recv_num_  = 0;
+    fc_enabled_         = true;
+  }
 
-    RDMA_ASSERT(current_idx_ == 0) << "There is pending reqs in the msg queue.";
-    srs_[0].wr.ud.ah = send_qp_->ahs_[node_id];
-    srs_[0].wr.ud.remote_qpn  = send_qp_->attrs_[node_id].qpn;
-    srs_[0].wr.ud.remote_qkey = DEFAULT_QKEY;
-    srs_[0].sg_list = &ssges_[0];
-    srs_[0].next = NULL;
+  /**
+   * Join the multicast group, whose messages are then received, and which can then be multicast to.
+   * The group is addressed by a multicast GID derived from group_id. On RoCE (including soft-RoCE),
+   * the GID is enough (mlid = 0); on InfiniBand, the group shall be created at the SM, e.g., by rdma_cm,
+   * and its MLID given. The membership is recorded at RdmaCtrl, so the remotes can query it.
+   * An adapter joins at most one group.
+   */
+  ConnStatus join_group(uint32_t group_id,uint16_t mlid = 0) {
 
-    srs_[0].send_flags = ((send_qp_->queue_empty()) ? IBV_SEND_SIGNALED : 0)
-                         | ((len < MAX_INLINE_SIZE) ? IBV_SEND_INLINE : 0);
+    RDMA_ASSERT(group_ah_ == nullptr) << "already joined group " << group_id_;
+    ibv_gid mgid = group_gid(group_id);
+    if(ibv_attach_mcast(qp_->qp_,&mgid,mlid) != 0) {
+      RDMA_LOG(WARNING) << "attach to multicast group " << group_id << " error: " << strerror(errno);
+      return ERR;
+    }
 
-    ssges_[0].addr = (uint64_t)msg;
-    ssges_[0].length = len;
+    ibv_ah_attr attr = {};
+    attr.is_global = 1;
+    attr.dlid      = mlid;
+    attr.port_num  = rnic_->port_id;
+    attr.grh.dgid  = mgid;
+    attr.grh.hop_limit  = 255;
+    attr.grh.sgid_index = rnic_->gid;
+    group_ah_ = rnic_->ah_cache.get(rnic_->pd,attr);
+    if(group_ah_ == nullptr) {
+      ibv_detach_mcast(qp_->qp_,&mgid,mlid);
+      return ERR;
+    }
+    group_id_ = group_id;
+    mlid_     = mlid;
+    cm_->register_group(group_id,worker_id_);
+    return SUCC;
+  }
 
+  void leave_group() {
+    if(group_ah_ == nullptr)
+      return;
+    cm_->unregister_group(group_id_,worker_id_);
+    ibv_gid mgid = group_gid(group_id_);
+    RDMA_VERIFY(WARNING,ibv_detach_mcast(qp_->qp_,&mgid,mlid_) == 0)
+        << "detach from multicast group " << group_id_ << " error: " << strerror(errno);
+    group_ah_ = nullptr;  // owned by the AH cache
+    group_members_.clear();
+  }
 
-    if(send_qp_->need_poll()) {
-      ibv_wc wc; auto ret = send_qp_->poll_till_completion(wc);
-      RDMA_ASSERT(ret == SUCC) << "poll UD completion reply error: " << ret;
-      send_qp_->pendings = 0;
-    } else
-      send_qp_->pendings += 1;
+  /**
+   * Query the adapter (of the same worker id) at the remote, and add it to the members of the group if
+   * it has joined. return NOT_READY if it has not joined (yet).
+   */
+  ConnStatus add_group_member(std::string ip,int port) {
+    RDMA_ASSERT(group_ah_ != nullptr) << "join a group before adding members";
+    int node_id;
+    auto ret = QPImpl::get_group_member(ip,port,group_id_,worker_id_,&node_id);
+    if(ret == SUCC && node_id != node_id_)
+      group_members_.insert(node_id);
+    return ret;
+  }
 
-    int rc = ibv_post_send(send_qp_->qp_, &srs_[0], &bad_sr_);
-    //reset next ptr
-    srs_[0].next = &srs_[1];
-    return (rc == 0)?SUCC:ERR;
+  inline const std::set<int> &group_members() const {
+    return group_members_;
   }
 
-  void prepare_pending() {
-    RDMA_ASSERT(current_idx_ == 0);
+  /**
+   * A broadcast to exactly the members of the group (except itself) is one multicast message;
+   * otherwise, or if the message does not fit in one packet, it is sent to each node.
+   */
+  ConnStatus broadcast_to(const std::set<int> &nodes,const char *msg,int len) {
+    std::vector<int> v(nodes.begin(),nodes.end());
+    if(covers_group(v) && len <= MAX_MSG_SIZE)
+      return multicast(msg,len);
+    return MsgAdapter::broadcast_to(nodes,msg,len);
   }
 
-  ConnStatus send_pending(int node_id,const char *msg,int len) {
+  ConnStatus broadcast_to(int *nodes,int num,const char *msg,int len) {
+    std::vector<int> v(nodes,nodes + num);
+    if(covers_group(v) && len <= MAX_MSG_SIZE)
+      return multicast(msg,len);
+    return MsgAdapter::broadcast_to(nodes,num,msg,len);
+  }
 
-    auto i = current_idx_++;
-    srs_[i].wr.ud.ah = send_qp_->ahs_[node_id];
-    srs_[i].wr.ud.remote_qpn  = send_qp_->attrs_[node_id].qpn;
-    srs_[i].wr.ud.remote_qkey = DEFAULT_QKEY;
+  // number of broadcasts sent by multicast
+  inline uint64_t multicasts() const {
+    return multicasts_;
+  }
+
+  /**
+   * Opt-in congestion control; it is off by default.
+   */
+  void enable_congestion_control(const CCConfig &config = default_cc_config()) {
+    cc_config_  = config;
+    cc_enabled_ = true;
+  }
+
+  inline bool congestion_control_enabled() const {
+    return cc_enabled_;
+  }
+
+  /**
+   * Feed an RTT sample to the node, which adjusts the sending rate to it
+   */
+  void rtt_sample(int node_id,uint64_t rtt_ns) {
+    if(!cc_enabled_)
+      return;
+    FlowPeer &f = flow(node_id);
+    f.pacer->set_rate(f.cc->on_rtt(rtt_ns,PathMonitor::now_ns()));
+  }
+
+  // the sending rate (bytes per second) to the node, 0 if congestion control is off
+  inline uint64_t rate(int node_id) {
+    return cc_enabled_ ? flow(node_id).cc->rate() : 0;
+  }
+
+  // number of packets queued for credits or the rate
+  inline uint64_t deferred() const {
+    return deferred_num_;
+  }
+
+  /**
+   * Deliver the messages of a poll in one call, instead of calling the callback per message.
+   * The batch is valid in the call, and its messages can be held (hold) like the ones of the callback.
+   * Messages reassembled or read by rendezvous are delivered in batches of one, after the batch of the
+   * messages received before them; so, as with the callback, messages are delivered in the order they
+   * complete at the receiver (a rendezvous message completes once its payload is read).
+   */
+  void set_batch_callback(std::function<void(const RecvMsg *msgs,int num)> callback) {
+    batch_callback_ = callback;
+  }
+
+  /**
+   * The callback is called with the message once a rendezvous message has been read by the receiver
+   */
+  void set_release_callback(std::function<void(const char *)> callback) {
+    release_callback_ = callback;
+  }
+
+  // number of rendezvous messages sent, which have not been released
+  inline int rndv_outstanding() const {
+    return rndv_outstanding_;
+  }
 
-    srs_[i].send_flags = ((send_qp_->queue_empty()) ? IBV_SEND_SIGNALED : 0)
-                         | ((len < MAX_INLINE_SIZE) ? IBV_SEND_INLINE : 0);
+  /**
+   * Number of send requests posted (or pended) so far.
+   * A buffer sent before it is no longer read by the RNIC once 2 * UDQPImpl::MAX_SEND_SIZE more are posted,
+   * since the send queue cannot hold them all.
+   */
+  inline uint64_t posted_wrs() const {
+    return posted_wrs_;
+  }
+
+  /**
+   * Number of send requests known to be completed; the ones numbered (by posted_wrs) up to it
+   * are no longer read by the RNIC. It is updated by poll_comps, without waiting.
+   */
+  inline uint64_t completed_wrs() const {
+    return completed_wrs_;
+  }
+
+  /**
+   * The callback is called (in poll_comps) with the cookie of a send_to_tracked message, once its send
+   * has completed, so its buffer can be reused.
+   */
+  void set_send_callback(std::function<void(uint64_t)> callback) {
+    send_callback_ = callback;
+  }
+
+  /**
+   * Send a message in one packet, and get its cookie back from the send callback once it completes.
+   */
+  ConnStatus send_to_tracked(int node_id,const char *msg,int len,uint64_t cookie) {
+    return send_tracked(node_id,msg,len,cookie,nullptr);
+  }
+
+  /**
+   * Send a message in one packet from a buffer of Rmalloc, which is owned (and Rfree-d) by the adapter
+   * once its send completes. If it fails, the buffer is still owned by the caller.
+   */
+  ConnStatus send_owned(int node_id,char *buf,int len) {
+    return send_tracked(node_id,buf,len,0,buf);
+  }
+
+  /**
+   * Take the ownership of the message given to the callback, so it is valid after the callback returns,
+   * until the handle (and its copies) are released. Only a message in one packet can be held;
+   * for others (e.g., fragmented or rendezvous ones), and outside the callback, the handle is invalid.
+   */
+  RecvHandle hold(const char *msg) {
+    RecvHandle h;
+    if(holdable_slot_ < 0 || msg != (const char *)(sges_[holdable_slot_].addr + GRH_SIZE)) {
+      holdable_slot_ = -1;
+      return h;
+    }
 
-    if(send_qp_->need_poll()) {
-      ibv_wc wc;auto ret = send_qp_->poll_till_completion(wc);
-      RDMA_ASSERT(ret == SUCC) << "poll UD completion reply error: " << ret;
-      send_qp_->pendings = 0;
+    char *spare;
+    if(!spare_bufs_.empty()) {
+      spare = spare_bufs_.back();
+      spare_bufs_.pop_back();
     } else {
-      send_qp_->pendings += 1;
+      spare = (char *)Rmalloc(RECV_BUF_STRIDE);
+      if(spare == nullptr) {
+        holdable_slot_ = -1;
+        return h;
+      }
     }
+    h.buf_ = (char *)(msg - GRH_SIZE);
+    new (h.meta()) RecvHandle::Meta();
+    h.meta()->refs.store(1,std::memory_order_relaxed);
+    h.meta()->len   = holdable_len_;
+    h.meta()->owner = this;
 
-    ssges_[i].addr = (uintptr_t)msg;
-    ssges_[i].length = len;
+    replace_recv_buf(holdable_slot_,spare);
+    holdable_slot_ = -1;  // held once
+    held_ += 1;
+    return h;
+  }
 
-    if(current_idx_ >= MAX_UD_SEND_DOORBELL)
-      flush_pending();
+  /**
+   * Hold a message of the batch given to the batch callback, in the callback
+   */
+  RecvHandle hold(const RecvMsg &m) {
+    // compare the addresses before subtracting, since m may not point into the batch
+    uintptr_t addr = (uintptr_t)&m;
+    if(addr < (uintptr_t)batch_ || addr >= (uintptr_t)(batch_ + batch_num_))
+      return RecvHandle();
+    int idx = &m - batch_;
+    if(batch_slots_[idx] < 0)
+      return RecvHandle();
+    holdable_slot_ = batch_slots_[idx];
+    holdable_len_  = m.len;
+    RecvHandle h = hold(m.msg);
+    if(h.valid())
+      batch_slots_[idx] = -1;
+    return h;
+  }
+
+  // number of receive buffers held by the application
+  inline int held() const {
+    return held_;
+  }
+
+  // the max bytes of the messages being reassembled; fragments of new messages beyond it are dropped
+  void set_reassembly_cap(uint64_t bytes) {
+    reassembly_cap_ = bytes;
+  }
+
+  // number of fragmented messages dropped at reassembly
+  inline uint64_t frag_drops() const {
+    return frag_drops_;
+  }
+
+  ConnStatus connect(std::string ip,int port) {
+    int node_id;
+    return connect(ip,port,&node_id);
+  }
+
+  /**
+   * Also tells the remote's node id.
+   * With rendezvous enabled, the RC QP for reading the remote's messages is connected as well, which needs
+   * the remote to have connected to this adapter; until then it returns NOT_READY, and the caller shall retry.
+   */
+  ConnStatus connect(std::string ip,int port,int *node_id) {
+    auto ret = send_qp_->connect(ip,port,create_ud_idx(worker_id_,RECV_QP_IDX),node_id);
+    if(ret == SUCC && rndv_enabled_)
+      ret = connect_rndv_peer(*node_id,ip,port);
+    return ret;
+  }
+
+  /**
+   * return NOT_READY if the message needs rendezvous, but the remote has not connected to this adapter yet
+   */
+  ConnStatus send_to(int node_id,const char *msg,int len) {
+    if(unlikely(len > eager_threshold_) && rndv_enabled_)
+      return send_rndv(node_id,msg,len,false);
+    if(unlikely(len > MAX_MSG_SIZE)) {
+      RDMA_ASSERT(current_idx_ == 0) << "There is pending reqs in the msg queue.";
+      auto ret = send_frags(node_id,msg,len);
+      return (ret == SUCC) ? flush_pending() : ret;
+    }
+    return send_eager(node_id,msg,len,MSG_EAGER);
+  }
+
+  void prepare_pending() {
+    RDMA_ASSERT(current_idx_ == 0);
+  }
+
+  ConnStatus send_pending(int node_id,const char *msg,int len) {
+    if(unlikely(len > eager_threshold_) && rndv_enabled_)
+      return send_rndv(node_id,msg,len,true);
+    if(unlikely(len > MAX_MSG_SIZE))
+      return send_frags(node_id,msg,len);
+    return send_pending_eager(node_id,msg,len,MSG_EAGER);
   }
 
   ConnStatus flush_pending() {
@@ -197,22 +673,69 @@ class UDAdapter : public MsgAdapter, public UDRecvManager {
      * The reply messages are batched in this call
      */
     prepare_pending();
-    for(uint i = 0;i < poll_result;++i) { // poll_result: number of results
+    for(int i = 0;i < poll_result;++i) { // poll_result: number of results
+      // prefetch the next message while handling this one
+      if(i + 1 < poll_result)
+        __builtin_prefetch((const char *)(wcs_[i + 1].wr_id + GRH_SIZE));
       RDMA_ASSERT(wcs_[i].status == IBV_WC_SUCCESS)
           << "error wc status " << wcs_[i].status << " at " << worker_id_;
-      callback_((const char *)(wcs_[i].wr_id + GRH_SIZE),::rdmaio::decode_qp_mac(wcs_[i].imm_data),
-                ::rdmaio::decode_qp_index(wcs_[i].imm_data));
+      const char *msg = (const char *)(wcs_[i].wr_id + GRH_SIZE);
+      int node_id = ::rdmaio::decode_qp_mac(wcs_[i].imm_data);
+      uint32_t index = ::rdmaio::decode_qp_index(wcs_[i].imm_data);
+      int tid  = index & TID_MASK;
+      int kind = index >> KIND_SHIFT;
+      if(unlikely(kind == MCAST)) {
+        // multicast is delivered to the local members as well, including the sender itself
+        if(node_id == node_id_ && tid == worker_id_)
+          continue;
+        kind = MSG_EAGER;
+      } else if(unlikely(fc_enabled_))
+        on_packet(node_id,kind,(index >> CREDIT_SHIFT) & CREDIT_MASK,msg);
+
+      switch(kind) {
+        case MSG_EAGER:
+          if(batch_callback_) {
+            batch_[batch_num_] = { .msg = msg,.len = (int)(wcs_[i].byte_len - GRH_SIZE),
+                                   .node_id = node_id,.tid = tid };
+            batch_slots_[batch_num_++] = (recv_tail_ + i) % max_recv_num_;
+            break;
+          }
+          holdable_slot_ = (recv_tail_ + i) % max_recv_num_;
+          holdable_len_  = wcs_[i].byte_len - GRH_SIZE;
+          callback_(msg,node_id,tid);
+          holdable_slot_ = -1;
+          break;
+        case RNDV_DESC:
+          start_read(node_id,tid,*((const RndvDesc *)msg));
+          break;
+        case RNDV_FIN:
+          release(*((const RndvDesc *)msg));
+          break;
+        case FRAG:
+          reassemble(node_id,tid,msg,wcs_[i].byte_len - GRH_SIZE);
+          break;
+      }
     }
+    flush_batch();
+    recv_tail_ = (recv_tail_ + poll_result) % max_recv_num_;
+    reap_sends();
+    if(unlikely(returned_num_.load(std::memory_order_relaxed) > 0))
+      reclaim();
+    if(unlikely(rndv_reads_ > 0))
+      poll_reads();
+    if(unlikely(cc_enabled_) && deferred_num_ > 0)
+      drain_paced();
+    if(unlikely(!reassemblies_.empty()) && (++polls_ % 1024) == 0)
+      expire_reassemblies();
     flush_pending(); // send the batched replies
-    idle_recv_num_ += poll_result;
-    if(idle_recv_num_ > max_idle_recv_num_) {
-      // re-post recvs to the QP
-      post_recvs(idle_recv_num_);
-      idle_recv_num_ = 0;
-    }
+    // re-post recvs to the QP
+    if(replenish_recvs(poll_result) && unlikely(fc_enabled_))
+      return_credits();
   }
 
  private:
+  friend class RecvHandle;
+
   const int node_id_;   // my node id
   const int worker_id_; // my thread id
   /**
@@ -224,9 +747,693 @@ class UDAdapter : public MsgAdapter, public UDRecvManager {
   struct ibv_send_wr *bad_sr_ = nullptr;
 
   int current_idx_ = 0;
+  uint64_t posted_wrs_ = 0;
+  uint64_t completed_wrs_ = 0;
+
+  /**
+   * Send completion structures
+   */
+  static const int SIGNAL_INTERVAL = MAX_UD_SEND_DOORBELL;
+
+  struct TrackedSend {
+    uint64_t wr;      // its WR number
+    uint64_t cookie;
+    char    *owned;   // the buffer to free, if owned by the adapter
+  };
+  // in the order of the WR numbers
+  std::deque<TrackedSend> tracked_;
+  std::function<void(uint64_t)> send_callback_;
 
   static const int RECV_QP_IDX = 1;
   static const int SEND_QP_IDX = 0;
+
+  /**
+   * The qp index in the immediate: | kind (3 bits) | returned credits (5 bits) | thread id (8 bits) |
+   */
+  enum {
+    MSG_EAGER = 0,
+    RNDV_DESC = 1,
+    RNDV_FIN  = 2,
+    FRAG      = 3,
+    CREDIT    = 4,  // an explicit credit update, whose payload is the number of credits
+    MCAST     = 5   // a message multicast to the group
+  };
+  static const int      KIND_SHIFT   = 13;
+  static const int      CREDIT_SHIFT = 8;
+  static const uint32_t CREDIT_MASK  = (1 << (KIND_SHIFT - CREDIT_SHIFT)) - 1;
+  static const uint32_t TID_MASK     = (1 << CREDIT_SHIFT) - 1;
+
+  /**
+   * rendezvous structures
+   */
+  std::shared_ptr<RdmaCtrl> cm_;
+  RNicHandler *rnic_;
+  MemoryAttr   local_mr_;
+
+  bool rndv_enabled_   = false;
+  int eager_threshold_ = MAX_PACKET_SIZE;
+  int max_rndv_size_   = 0;
+  std::function<void(const char *)> release_callback_;
+  int rndv_outstanding_ = 0;
+
+  struct RndvRead {
+    int      tid;
+    char    *buf;
+    RndvDesc desc;
+  };
+
+  struct RndvPeer {
+    std::string ip;
+    int port = 0;
+    RCQP *qp = nullptr;
+    bool connected = false;
+    // reads complete in order on the RC QP, so the front one is the next to complete
+    std::deque<RndvRead> inflight;
+    // reads exceeding the send queue, or waiting for a buffer
+    std::deque<RndvRead> waiting;
+  };
+  std::vector<RndvPeer> rndv_peers_;
+  int rndv_reads_ = 0;  // inflight & waiting ones
+  // descriptors (and their echoes) to send, one per doorbell slot; they are always inlined
+  RndvDesc descs_[MAX_UD_SEND_DOORBELL];
+
+  /**
+   * fragmentation structures
+   */
+  static const int MAX_FRAG_HEADERS = UDQPImpl::MAX_SEND_SIZE * 2;
+  FragHeader *frag_hdrs_ = nullptr;
+  uint64_t    frag_seq_  = 0;
+  ibv_sge     frag_sges_[MAX_UD_SEND_DOORBELL][2];
+  uint32_t    next_msg_id_ = 0;
+
+  struct Reassembly {
+    char    *buf;
+    uint32_t received;
+    uint32_t total_len;
+    uint64_t start_ns;
+  };
+  // partial messages, keyed by the sender's (node, thread) and the message id
+  std::unordered_map<uint64_t,Reassembly> reassemblies_;
+  uint64_t reassembly_bytes_ = 0;
+  uint64_t reassembly_cap_   = DEFAULT_REASSEMBLY_CAP;
+  uint64_t frag_drops_       = 0;
+  uint64_t polls_            = 0;
+
+  /**
+   * flow control structures
+   */
+  struct Deferred {
+    int   kind;
+    char *buf;
+    int   len;
+  };
+
+  struct FlowPeer {
+    // sender side
+    int credits = 0;
+    std::deque<Deferred> deferred;
+    std::unique_ptr<RateController> cc;
+    std::unique_ptr<TokenBucket>    pacer;
+    // receiver side
+    uint32_t consumed   = 0;  // buffers consumed, which have not been re-posted
+    uint32_t returnable = 0;  // buffers re-posted, whose credits have not been returned
+  };
+
+  bool fc_enabled_        = false;
+  bool cc_enabled_        = false;
+  CCConfig cc_config_;
+  int credits_per_sender_ = 0;
+  uint32_t credit_batch_  = 0;
+  std::vector<FlowPeer> flows_;
+  std::vector<int>      consumers_;  // nodes with consumed buffers
+  uint64_t deferred_num_  = 0;
+  // queued packets posted, which may still be read by the RNIC
+  std::deque<std::pair<uint64_t,char *> > retired_;
+  uint32_t credit_updates_[MAX_UD_SEND_DOORBELL];
+
+  // the immediate of a packet to the node, which also returns (some of) the credits of the node
+  inline uint32_t imm_of(int node_id,int kind) {
+    uint32_t credits = 0;
+    if(unlikely(fc_enabled_)) {
+      FlowPeer &f = flow(node_id);
+      credits = std::min(f.returnable,CREDIT_MASK);
+      f.returnable -= credits;
+    }
+    return ::rdmaio::encode_qp_id(node_id_,worker_id_ | (credits << CREDIT_SHIFT) | (kind << KIND_SHIFT));
+  }
+
+  ConnStatus send_eager(int node_id,const char *msg,int len,int kind,int flags = 0) {
+
+    RDMA_ASSERT(current_idx_ == 0) << "There is pending reqs in the msg queue.";
+    if(unlikely(fc_enabled_ || cc_enabled_) && !may_send(node_id,kind,len))
+      return defer(node_id,kind,msg,len);
+    srs_[0].wr.ud.ah = send_qp_->ah(node_id);
+    srs_[0].wr.ud.remote_qpn  = send_qp_->remote_qpn(node_id);
+    srs_[0].wr.ud.remote_qkey = DEFAULT_QKEY;
+    srs_[0].sg_list = &ssges_[0];
+    srs_[0].num_sge = 1;
+    srs_[0].imm_data = imm_of(node_id,kind);
+    srs_[0].next = NULL;
+
+    number_wr(srs_[0],flags | ((len < MAX_INLINE_SIZE) ? IBV_SEND_INLINE : 0));
+
+    ssges_[0].addr = (uint64_t)msg;
+    ssges_[0].length = len;
+
+    int rc = ibv_post_send(send_qp_->qp_, &srs_[0], &bad_sr_);
+    //reset next ptr
+    srs_[0].next = &srs_[1];
+    return (rc == 0)?SUCC:ERR;
+  }
+
+  ConnStatus send_pending_eager(int node_id,const char *msg,int len,int kind,int flags = 0) {
+    if(unlikely(fc_enabled_ || cc_enabled_) && !may_send(node_id,kind,len))
+      return defer(node_id,kind,msg,len);
+    pend(node_id,msg,len,kind,flags);
+    return SUCC;
+  }
+
+  void pend(int node_id,const char *msg,int len,int kind,int flags = 0) {
+
+    auto i = current_idx_;
+    srs_[i].sg_list = &ssges_[i];
+    srs_[i].num_sge = 1;
+    ssges_[i].addr = (uintptr_t)msg;
+    ssges_[i].length = len;
+    enqueue(node_id,kind,flags | ((len < MAX_INLINE_SIZE) ? IBV_SEND_INLINE : 0));
+  }
+
+  /**
+   * Number the WR, and signal it if it is tracked, or every SIGNAL_INTERVAL WRs.
+   * The WR's number is its wr_id, and the send queue completes in order, so a completion means
+   * all WRs up to its number have completed.
+   * Only if the send queue is full, the completions are polled until there is room.
+   */
+  inline void number_wr(ibv_send_wr &sr,int flags) {
+    while(unlikely(posted_wrs_ - completed_wrs_ >= UDQPImpl::MAX_SEND_SIZE))
+      reap_sends();
+    posted_wrs_ += 1;
+    sr.wr_id = posted_wrs_;
+    sr.send_flags = flags | ((posted_wrs_ % SIGNAL_INTERVAL == 0) ? IBV_SEND_SIGNALED : 0);
+  }
+
+  // poll the send completions without waiting, and notify the tracked sends which have completed
+  void reap_sends() {
+    ibv_wc wcs[SIGNAL_INTERVAL];
+    int n = ibv_poll_cq(send_qp_->cq_,SIGNAL_INTERVAL,wcs);
+    for(int i = 0;i < n;++i) {
+      RDMA_ASSERT(wcs[i].status == IBV_WC_SUCCESS)
+          << "UD send completion error: " << ibv_wc_status_str(wcs[i].status);
+      completed_wrs_ = std::max(completed_wrs_,(uint64_t)wcs[i].wr_id);
+    }
+    while(!tracked_.empty() && tracked_.front().wr <= completed_wrs_) {
+      TrackedSend &t = tracked_.front();
+      if(t.owned != nullptr)
+        Rfree(t.owned);
+      else if(send_callback_)
+        send_callback_(t.cookie);
+      tracked_.pop_front();
+    }
+  }
+
+  ConnStatus send_tracked(int node_id,const char *msg,int len,uint64_t cookie,char *owned) {
+
+    RDMA_ASSERT(len <= MAX_MSG_SIZE && !(rndv_enabled_ && len > eager_threshold_))
+        << "only a message in one packet can be tracked";
+    uint64_t posted = posted_wrs_;
+    // in a batch (e.g., in the callback), pend it after the batched ones
+    auto ret = (current_idx_ == 0) ? send_eager(node_id,msg,len,MSG_EAGER,IBV_SEND_SIGNALED)
+               : send_pending_eager(node_id,msg,len,MSG_EAGER,IBV_SEND_SIGNALED);
+    if(ret == SUCC)
+      // not posted means it is copied for credits or the rate, so it is done at once
+      tracked_.push_back({ .wr = (posted_wrs_ != posted) ? posted_wrs_ : 0,.cookie = cookie,.owned = owned });
+    return ret;
+  }
+
+  // fill the destination & flags of the current doorbell slot, and post them once the doorbell is full
+  void enqueue(int node_id,int kind,int flags) {
+
+    auto i = current_idx_++;
+    srs_[i].wr.ud.ah = send_qp_->ah(node_id);
+    srs_[i].wr.ud.remote_qpn  = send_qp_->remote_qpn(node_id);
+    srs_[i].wr.ud.remote_qkey = DEFAULT_QKEY;
+    srs_[i].imm_data = imm_of(node_id,kind);
+
+    number_wr(srs_[i],flags);
+
+    if(current_idx_ >= MAX_UD_SEND_DOORBELL)
+      flush_pending();
+  }
+
+  /**
+   * Pend the fragments of the message; each one gathers its header and a slice of the message.
+   */
+  ConnStatus send_frags(int node_id,const char *msg,int len) {
+
+    if(len > MAX_FRAG_MSG_SIZE)
+      return WRONG_ARG;
+
+    uint32_t msg_id = next_msg_id_++;
+    for(uint32_t off = 0;off < (uint32_t)len;off += FRAG_PAYLOAD) {
+      FragHeader header = { .msg_id = msg_id,.total_len = (uint32_t)len,.offset = off,.reserved = 0 };
+      if(unlikely(fc_enabled_ || cc_enabled_) &&
+         !may_send(node_id,FRAG,sizeof(FragHeader) + std::min((uint32_t)FRAG_PAYLOAD,len - off))) {
+        auto ret = defer(node_id,FRAG,(char *)(&header),sizeof(FragHeader),
+                         msg + off,std::min((uint32_t)FRAG_PAYLOAD,len - off));
+        if(ret != SUCC)
+          return ret;
+        continue;
+      }
+
+      auto i = current_idx_;
+      // a header is reused after the send queue wraps twice, so its previous send has completed
+      FragHeader &h = frag_hdrs_[(frag_seq_++) % MAX_FRAG_HEADERS];
+      h = header;
+
+      frag_sges_[i][0] = { .addr = (uintptr_t)(&h),.length = sizeof(FragHeader),.lkey = local_mr_.key };
+      frag_sges_[i][1] = { .addr = (uintptr_t)(msg + off),.length = std::min((uint32_t)FRAG_PAYLOAD,len - off),
+                           .lkey = local_mr_.key };
+      srs_[i].sg_list = frag_sges_[i];
+      srs_[i].num_sge = 2;
+      enqueue(node_id,FRAG,0);
+    }
+    return SUCC;
+  }
+
+  inline FlowPeer &flow(int node_id) {
+    if((size_t)node_id >= flows_.size()) {
+      uint old = flows_.size();
+      flows_.resize(node_id + 1);
+      for(uint i = old;i < flows_.size();++i)
+        flows_[i].credits = credits_per_sender_;
+    }
+    FlowPeer &f = flows_[node_id];
+    if(unlikely(cc_enabled_) && f.cc == nullptr) {
+      f.cc.reset(new RateController(cc_config_));
+      f.pacer.reset(new TokenBucket(cc_config_.line_rate,cc_config_.burst));
+    }
+    return f;
+  }
+
+  /**
+   * Take a credit & the tokens for the packet; return false if it shall be queued.
+   * Credit updates are neither flow nor congestion controlled, since the receiver reserves buffers for them.
+   */
+  inline bool may_send(int node_id,int kind,int len) {
+    if(kind == CREDIT)
+      return true;
+    FlowPeer &f = flow(node_id);
+    // the queued ones go first
+    if(!f.deferred.empty())
+      return false;
+    if(fc_enabled_ && f.credits == 0)
+      return false;
+    if(cc_enabled_ && !f.pacer->try_consume(len))
+      return false;
+    if(fc_enabled_)
+      f.credits -= 1;
+    return true;
+  }
+
+  // post the queued packets of the node, as many as the credits & the rate allow
+  void drain(int node_id) {
+    FlowPeer &f = flows_[node_id];
+    while(!f.deferred.empty()) {
+      Deferred d = f.deferred.front();
+      if(fc_enabled_ && f.credits == 0)
+        break;
+      if(cc_enabled_ && !f.pacer->try_consume(d.len))
+        break;
+      if(fc_enabled_)
+        f.credits -= 1;
+      f.deferred.pop_front();
+      deferred_num_ -= 1;
+      pend(node_id,d.buf,d.len,d.kind);
+      // freed once its send completes
+      retired_.push_back(std::make_pair(posted_wrs_,d.buf));
+    }
+    while(!retired_.empty() && completed_wrs_ >= retired_.front().first) {
+      Rfree(retired_.front().second);
+      retired_.pop_front();
+    }
+  }
+
+  void drain_paced() {
+    for(uint n = 0;n < flows_.size();++n) {
+      if(!flows_[n].deferred.empty())
+        drain(n);
+    }
+  }
+
+  /**
+   * Queue a copy of the packet (gathered from two parts) until the node returns credits
+   */
+  ConnStatus defer(int node_id,int kind,const char *msg,int len,const char *tail = nullptr,int tail_len = 0) {
+    char *buf = (char *)Rmalloc(len + tail_len);
+    if(buf == nullptr)
+      return ERR;
+    memcpy(buf,msg,len);
+    if(tail_len > 0)
+      memcpy(buf + len,tail,tail_len);
+    flow(node_id).deferred.push_back({ .kind = kind,.buf = buf,.len = len + tail_len });
+    deferred_num_ += 1;
+    return SUCC;
+  }
+
+  // handle the credits carried by a packet from the node, and count the buffer it consumes
+  void on_packet(int node_id,int kind,uint32_t credits,const char *msg) {
+    FlowPeer &f = flow(node_id);
+    if(kind == CREDIT)
+      credits += *((const uint32_t *)msg);
+    else if(f.consumed++ == 0)
+      consumers_.push_back(node_id);
+
+    if(credits == 0)
+      return;
+    f.credits += credits;
+    if(!f.deferred.empty())
+      drain(node_id);
+  }
+
+  // the buffers consumed have been re-posted, so their credits can be returned
+  void return_credits() {
+    prepare_pending();
+    for(int n : consumers_) {
+      FlowPeer &f = flows_[n];
+      f.returnable += f.consumed;
+      f.consumed = 0;
+      if(f.returnable < credit_batch_)
+        continue; // piggybacked later
+      uint32_t &update = credit_updates_[current_idx_];
+      update = f.returnable;
+      f.returnable = 0;
+      pend(n,(char *)(&update),sizeof(uint32_t),CREDIT);
+    }
+    consumers_.clear();
+    flush_pending();
+  }
+
+  void reassemble(int node_id,int tid,const char *pkt,uint32_t pkt_len) {
+
+    const FragHeader &h = *((const FragHeader *)pkt);
+    uint32_t len = pkt_len - sizeof(FragHeader);
+    uint64_t key = ((uint64_t)::rdmaio::encode_qp_id(node_id,tid) << 32) | h.msg_id;
+
+    auto it = reassemblies_.find(key);
+    if(it == reassemblies_.end()) {
+      char *buf = nullptr;
+      if(h.total_len > MAX_FRAG_MSG_SIZE || reassembly_bytes_ + h.total_len > reassembly_cap_ ||
+         (buf = (char *)Rmalloc(h.total_len)) == nullptr) {
+        frag_drops_ += 1;
+        return;
+      }
+      reassembly_bytes_ += h.total_len;
+      it = reassemblies_.emplace(key,Reassembly { .buf = buf,.received = 0,.total_len = h.total_len,
+                                                  .start_ns = PathMonitor::now_ns() }).first;
+    }
+    Reassembly &r = it->second;
+    if(h.offset + len > h.total_len) {
+      RDMA_LOG(WARNING) << "invalid fragment at " << h.offset << " of message " << h.msg_id << " from " << node_id;
+      return;
+    }
+    memcpy(r.buf + h.offset,pkt + sizeof(FragHeader),len);
+    r.received += len;
+    if(r.received < h.total_len)
+      return;
+
+    deliver(r.buf,h.total_len,node_id,tid);
+    Rfree(r.buf);
+    reassembly_bytes_ -= h.total_len;
+    reassemblies_.erase(it);
+  }
+
+  // drop the partial messages, whose fragments are lost
+  void expire_reassemblies() {
+    uint64_t now = PathMonitor::now_ns();
+    for(auto it = reassemblies_.begin();it != reassemblies_.end();) {
+      if(now - it->second.start_ns < REASSEMBLY_TIMEOUT_US * 1000ULL) {
+        ++it;
+        continue;
+      }
+      reassembly_bytes_ -= it->second.total_len;
+      Rfree(it->second.buf);
+      frag_drops_ += 1;
+      it = reassemblies_.erase(it);
+    }
+  }
+
+  ConnStatus send_rndv(int node_id,const char *msg,int len,bool pending) {
+
+    if(len > max_rndv_size_)
+      return WRONG_ARG;
+    // the remote reads from this QP, so it must be connected first
+    if(rndv_qp(node_id) == nullptr)
+      return NOT_READY;
+
+    RndvDesc &desc = descs_[pending ? current_idx_ : 0];
+    desc = { .addr = (uint64_t)msg,.rkey = local_mr_.key,.len = (uint32_t)len };
+    rndv_outstanding_ += 1;
+    return pending ? send_pending_eager(node_id,(char *)(&desc),sizeof(RndvDesc),RNDV_DESC)
+        : send_eager(node_id,(char *)(&desc),sizeof(RndvDesc),RNDV_DESC);
+  }
+
+  void release(const RndvDesc &desc) {
+    rndv_outstanding_ -= 1;
+    if(release_callback_)
+      release_callback_((const char *)desc.addr);
+  }
+
+  /**
+   * Create the rendezvous QP to the node, and connect it to the remote's one.
+   * return NOT_READY if the remote has not created its QP, i.e., it has not connected to this adapter.
+   */
+  ConnStatus connect_rndv_peer(int node_id,std::string ip,int port) {
+    if((size_t)node_id >= rndv_peers_.size())
+      rndv_peers_.resize(node_id + 1);
+    RndvPeer &p = rndv_peers_[node_id];
+    p.ip   = ip;
+    p.port = port;
+    // created before connecting, so that the remote can connect to it
+    if(p.qp == nullptr)
+      p.qp = cm_->create_rc_qp(QPIdx {.node_id = node_id,.worker_id = worker_id_,.index = RNDV_QP_IDX },
+                               rnic_,&local_mr_);
+    if(p.connected)
+      return SUCC;
+
+    ConnArg arg = {}; ConnReply reply = {};
+    arg.type = ConnArg::QP;
+    arg.payload.qp.from_node   = node_id_;
+    arg.payload.qp.from_worker = worker_id_;
+    arg.payload.qp.from_index  = RNDV_QP_IDX;
+    arg.payload.qp.qp_type     = IBV_QPT_RC;
+
+    if(QPImpl::get_remote_helper(&arg,&reply,p.ip,p.port) != SUCC)
+      return NOT_READY;
+    auto ret = p.qp->connect(reply.payload.qp);
+    p.connected = (ret == SUCC);
+    return ret;
+  }
+
+  /**
+   * Get the connected rendezvous QP to the node, nullptr if connect() has not connected it.
+   * It never connects here, since a connection is a blocking handshake with the remote.
+   */
+  inline RCQP *rndv_qp(int node_id) {
+    if((size_t)node_id >= rndv_peers_.size() || !rndv_peers_[node_id].connected)
+      return nullptr;
+    return rndv_peers_[node_id].qp;
+  }
+
+  void send_fin(int node_id,const RndvDesc &desc) {
+    if(current_idx_ >= MAX_UD_SEND_DOORBELL)
+      flush_pending();
+    descs_[current_idx_] = desc;
+    send_pending_eager(node_id,(char *)(&descs_[current_idx_]),sizeof(RndvDesc),RNDV_FIN);
+  }
+
+  void start_read(int node_id,int tid,const RndvDesc &desc) {
+
+    if(desc.len > (uint32_t)max_rndv_size_ || rndv_qp(node_id) == nullptr) {
+      RDMA_LOG(WARNING) << "drop rendezvous message of " << desc.len << " bytes from " << node_id
+                        << ", which is too large or not connected";
+      send_fin(node_id,desc);
+      return;
+    }
+    rndv_peers_[node_id].waiting.push_back({ .tid = tid,.buf = nullptr,.desc = desc });
+    rndv_reads_ += 1;
+  }
+
+  // post the waiting reads of the peer, as many as the send queue allows
+  void post_reads(int node_id) {
+
+    RndvPeer &p = rndv_peers_[node_id];
+    while(!p.waiting.empty() && p.inflight.size() < RCQPImpl::RC_MAX_SEND_SIZE) {
+      RndvRead &r = p.waiting.front();
+      if(r.buf == nullptr && (r.buf = (char *)Rmalloc(r.desc.len)) == nullptr)
+        return; // retry once some buffers are freed
+
+      MemoryAttr remote_mr = { .buf = 0,.key = r.desc.rkey };
+      auto ret = p.qp->post_send_to_mr(local_mr_,remote_mr,IBV_WR_RDMA_READ,r.buf,r.desc.len,r.desc.addr,
+                                       IBV_SEND_SIGNALED,node_id);
+      if(ret != SUCC)
+        return;
+      p.inflight.push_back(r);
+      p.waiting.pop_front();
+    }
+  }
+
+  void poll_reads() {
+
+    ibv_wc wc;
+    for(uint n = 0;n < rndv_peers_.size();++n) {
+      RndvPeer &p = rndv_peers_[n];
+      while(!p.inflight.empty() && ibv_poll_cq(p.qp->cq_,1,&wc) == 1) {
+        RndvRead r = p.inflight.front();
+        p.inflight.pop_front();
+        rndv_reads_ -= 1;
+
+        if(wc.status == IBV_WC_SUCCESS)
+          deliver(r.buf,r.desc.len,n,r.tid);
+        else
+          RDMA_LOG(WARNING) << "read rendezvous message from " << n << " error: " << ibv_wc_status_str(wc.status);
+        Rfree(r.buf);
+        send_fin(n,r.desc);
+      }
+      post_reads(n);
+    }
+  }
+
+  /**
+   * Multicast structures
+   */
+  // a multicast packet is sent to the QPN reserved for multicast
+  static const uint32_t MCAST_QPN = 0xffffff;
+
+  ibv_ah  *group_ah_ = nullptr;
+  uint32_t group_id_ = 0;
+  uint16_t mlid_     = 0;
+  std::set<int> group_members_;  // the remote members, excluding itself
+  uint64_t multicasts_ = 0;
+
+  // the multicast GID of the group: ff0e::ffff:239.x.y.z, so that RoCE maps it to an IPv4 multicast address
+  static ibv_gid group_gid(uint32_t group_id) {
+    ibv_gid gid = {};
+    gid.raw[0]  = 0xff;
+    gid.raw[1]  = 0x0e;
+    gid.raw[10] = 0xff;
+    gid.raw[11] = 0xff;
+    gid.raw[12] = 239;
+    gid.raw[13] = (group_id >> 16) & 0xff;
+    gid.raw[14] = (group_id >> 8) & 0xff;
+    gid.raw[15] = group_id & 0xff;
+    return gid;
+  }
+
+  // whether the nodes (excluding itself) are exactly the members of the group
+  bool covers_group(std::vector<int> &nodes) {
+    if(group_ah_ == nullptr || group_members_.empty())
+      return false;
+    std::sort(nodes.begin(),nodes.end());
+    nodes.erase(std::unique(nodes.begin(),nodes.end()),nodes.end());
+    nodes.erase(std::remove(nodes.begin(),nodes.end(),node_id_),nodes.end());
+    return nodes.size() == group_members_.size() &&
+        std::equal(nodes.begin(),nodes.end(),group_members_.begin());
+  }
+
+  /**
+   * Multicast bypasses the flow control (its packets use the receive buffers not granted as credits)
+   * and the congestion control.
+   */
+  ConnStatus multicast(const char *msg,int len) {
+
+    // the pended WRs are numbered before it, so they are posted first
+    auto ret = flush_pending();
+    if(ret != SUCC)
+      return ret;
+
+    ibv_sge sge = { .addr = (uintptr_t)msg,.length = (uint32_t)len,.lkey = local_mr_.key };
+    ibv_send_wr sr = {};
+    sr.opcode  = IBV_WR_SEND_WITH_IMM;
+    sr.sg_list = &sge;
+    sr.num_sge = 1;
+    sr.imm_data = ::rdmaio::encode_qp_id(node_id_,worker_id_ | (MCAST << KIND_SHIFT));
+    sr.wr.ud.ah = group_ah_;
+    sr.wr.ud.remote_qpn  = MCAST_QPN;
+    sr.wr.ud.remote_qkey = DEFAULT_QKEY;
+    number_wr(sr,(len < MAX_INLINE_SIZE) ? IBV_SEND_INLINE : 0);
+
+    multicasts_ += 1;
+    int rc = ibv_post_send(send_qp_->qp_,&sr,&bad_sr_);
+    return (rc == 0) ? SUCC : ERR;
+  }
+
+  /**
+   * Batched delivery
+   */
+  std::function<void(const RecvMsg *,int)> batch_callback_;
+  RecvMsg batch_[UDQPImpl::MAX_RECV_SIZE];
+  int     batch_slots_[UDQPImpl::MAX_RECV_SIZE];  // the receive slot of each message, -1 once held
+  int     batch_num_ = 0;
+
+  inline void flush_batch() {
+    if(batch_num_ > 0) {
+      batch_callback_(batch_,batch_num_);
+      batch_num_ = 0;
+    }
+  }
+
+  inline void deliver(const char *msg,int len,int node_id,int tid) {
+    if(batch_callback_) {
+      flush_batch();  // the messages received before it are delivered first
+      RecvMsg m = { .msg = msg,.len = len,.node_id = node_id,.tid = tid };
+      batch_callback_(&m,1);
+    } else
+      callback_(msg,node_id,tid);
+  }
+
+  /**
+   * Held buffers
+   */
+  static const int MAX_SPARE_BUFS = 256;
+
+  int holdable_slot_ = -1;  // the slot of the message in the callback, -1 if it cannot be held
+  int holdable_len_  = 0;
+  int held_ = 0;
+  std::vector<char *> spare_bufs_;
+
+  // released buffers, which may come from other threads
+  std::mutex        returned_lock_;
+  std::vector<char *> returned_;
+  std::atomic<int>  returned_num_ = { 0 };
+
+  void recycle(char *buf) {
+    std::lock_guard<std::mutex> guard(returned_lock_);
+    returned_.push_back(buf);
+    returned_num_.fetch_add(1,std::memory_order_release);
+  }
+
+  void reclaim() {
+    std::vector<char *> bufs;
+    {
+      std::lock_guard<std::mutex> guard(returned_lock_);
+      bufs.swap(returned_);
+      returned_num_.store(0,std::memory_order_relaxed);
+    }
+    held_ -= bufs.size();
+    for(char *buf : bufs) {
+      // buffers of the slab cannot be freed, and are always kept
+      if(spare_bufs_.size() >= MAX_SPARE_BUFS && !in_slab(buf))
+        Rfree(buf);
+      else
+        spare_bufs_.push_back(buf);
+    }
+  }
 };
 
+inline void RecvHandle::reset() {
+  if(buf_ != nullptr && meta()->refs.fetch_sub(1,std::memory_order_acq_rel) == 1)
+    meta()->owner->recycle(buf_);
+  buf_ = nullptr;
+}
+
 } // namespace rdmaio
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <sys/time.h>
+#include <infiniband/verbs.h>
+
+#include "mr.hpp"
+#include "pre_connector.hpp"
+
+namespace rdmaio {
+
+/**
+ * Merge small RDMA writes to contiguous (or overlapping) remote ranges into one write.
+ * The merged payloads are copied to a staging buffer, which must be inside the QP's local MR.
+ *
+ * The staging buffer is split into two halves. The last write of a half is signaled,
+ * and a half is reused only after its signaled write completes.
+ * This class only keeps the states, the QP (RRCQP) posts the merged writes.
+ */
+class WriteCombiner {
+ public:
+  static const int      DEFAULT_WINDOW_SIZE = 1024; // max bytes of one merged write
+  static const int      DEFAULT_WINDOW_US   = 10;   // max time a write can be delayed
+  static const uint64_t WR_ID_BASE          = 0xc0b1000000000000ULL;
+
+  // a merged write
+  struct Run {
+    MemoryAttr remote_mr;
+    uint64_t   off;
+    uint32_t   len;
+    char      *buf;
+    bool       signaled;
+    uint64_t   wr_id;
+  };
+
+  WriteCombiner(char *staging,uint32_t staging_size,uint32_t window_size,uint32_t window_us):
+      staging_(staging),
+      half_size_(staging_size / 2),
+      window_size_(window_size),
+      window_us_(window_us),
+      cursor_(staging)
+  {
+    RDMA_ASSERT(window_size_ <= half_size_) << "write combining window is larger than half of the staging buffer.";
+  }
+
+  inline uint32_t window_size() const {
+    return window_size_;
+  }
+
+  inline bool empty() const {
+    return run_.len == 0;
+  }
+
+  /**
+   * Whether the pending writes overlap with the remote range
+   */
+  inline bool overlap(const MemoryAttr &remote_mr,uint64_t off,uint32_t len) const {
+    return !empty() && remote_mr.key == run_.remote_mr.key && remote_mr.buf == run_.remote_mr.buf &&
+        off < run_.off + run_.len && run_.off < off + len;
+  }
+
+  /**
+   * Whether the pending writes have been delayed longer than the window
+   */
+  inline bool expired() const {
+    if(empty())
+      return false;
+    struct timeval now; gettimeofday(&now,nullptr);
+    return diff_time(now,start_time_) >= window_us_;
+  }
+
+  /**
+   * Merge the write to the pending one, or start a new pending write if there is none.
+   * return false if the write cannot be merged, so the pending one shall be flushed first.
+   */
+  bool merge(const MemoryAttr &remote_mr,const char *buf,uint32_t len,uint64_t off) {
+
+    if(empty()) {
+      run_.remote_mr = remote_mr;
+      run_.off = off;
+      run_.len = len;
+      run_.buf = cursor_;
+      memcpy(cursor_,buf,len);
+      gettimeofday(&start_time_,nullptr);
+      return true;
+    }
+
+    if(remote_mr.key != run_.remote_mr.key || remote_mr.buf != run_.remote_mr.buf)
+      return false;
+    // only contiguous or overlapping writes after the start of the pending one are merged
+    if(off < run_.off || off > run_.off + run_.len)
+      return false;
+    uint64_t end = std::max(off + len,run_.off + run_.len);
+    if(end - run_.off > window_size_)
+      return false;
+
+    memcpy(run_.buf + (off - run_.off),buf,len);
+    run_.len = end - run_.off;
+    return true;
+  }
+
+  /**
+   * Take the pending write to post.
+   * If the returned one is signaled, the caller shall wait until half_busy() is false before the next merge.
+   */
+  Run take() {
+    Run res = run_;
+    run_.len = 0;
+
+    cursor_ += (res.len + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+    char *half_end = staging_ + (cur_half_ + 1) * half_size_;
+    res.signaled = (half_end - cursor_) < window_size_;
+    res.wr_id    = WR_ID_BASE | cur_half_;
+
+    if(res.signaled) {
+      busy_[cur_half_] = true;
+      cur_half_ ^= 1;
+      cursor_ = staging_ + cur_half_ * half_size_;
+    }
+    return res;
+  }
+
+  /**
+   * Release the half of a taken write, which fails to be posted
+   */
+  inline void cancel(const Run &run) {
+    if(run.signaled)
+      busy_[run.wr_id & 1] = false;
+  }
+
+  /**
+   * Whether the current half is still used by in-flight writes
+   */
+  inline bool half_busy() const {
+    return busy_[cur_half_];
+  }
+
+  /**
+   * Handle a completion polled from the QP's CQ.
+   * return true if it is a successful completion of the combined writes,
+   * which shall not be passed to the user.
+   */
+  bool on_completion(const ibv_wc &wc) {
+    if((wc.wr_id & ~1ULL) != WR_ID_BASE)
+      return false;
+    busy_[wc.wr_id & 1] = false;
+    return wc.status == IBV_WC_SUCCESS;
+  }
+
+ private:
+  char *const    staging_;
+  const uint32_t half_size_;
+  const uint32_t window_size_;
+  const uint32_t window_us_;
+
+  char *cursor_;
+  int   cur_half_ = 0;
+  bool  busy_[2] = {false,false};
+
+  Run run_ = {};
+  struct timeval start_time_;
+};
+
+} // namespace rdmaio